@@ -0,0 +1,68 @@
+/* Directory diff utility - Contents comparison throughput benchmark
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <compare.hpp>
+#include <print.hpp>
+#include <vector>
+
+// Compares two identical files with every backend. The files are compared
+// once before measuring, so the numbers reflect a warm page cache, and as
+// such the overhead of the backends themselves. Set DIR_DIFF_BENCH_DIR to
+// put the files on a specific filesystem.
+int main() {
+	constexpr size_t size = 256 * 1024 * 1024;
+	constexpr int runs = 5;
+
+	auto env_dir = std::getenv("DIR_DIFF_BENCH_DIR");
+	auto dir = fs::path{env_dir ? env_dir : fs::temp_directory_path()};
+	auto a = dir / "dir-diff-bench-a", b = dir / "dir-diff-bench-b";
+
+	{
+		std::vector<char> data(size);
+		for (size_t i = 0; i < size; i++)
+			data[i] = static_cast<char>((i * 2654435761u) >> 13);
+
+		std::ofstream{a, std::ios::binary}.write(data.data(), size);
+		std::ofstream{b, std::ios::binary}.write(data.data(), size);
+	}
+
+	std::vector<fs::path> bs{b};
+	std::vector<content_result> results;
+
+	for (auto backend : {io_backend::stream, io_backend::read, io_backend::mmap}) {
+		compare_io = backend;
+		are_contents_different(a, bs, results);
+
+		double best = 0;
+		for (int i = 0; i < runs; i++) {
+			auto start = std::chrono::steady_clock::now();
+			are_contents_different(a, bs, results);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			best = std::max(best, 2 * size / elapsed.count() / 1e9);
+		}
+
+		fmtns::print("{0:>8}: {1:.2f} GB/s\n", io_backend_name(backend), best);
+	}
+
+	fs::remove(a);
+	fs::remove(b);
+}
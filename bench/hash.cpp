@@ -0,0 +1,54 @@
+/* Directory diff utility - Hashing throughput benchmark
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <hash.hpp>
+#include <print.hpp>
+#include <vector>
+
+int main() {
+	constexpr size_t size = 256 * 1024 * 1024;
+	constexpr int runs = 5;
+
+	std::vector<std::byte> data(size);
+	for (size_t i = 0; i < size; i++)
+		data[i] = static_cast<std::byte>((i * 2654435761u) >> 13);
+
+	for (auto algo : {hash_algorithm::xxh3, hash_algorithm::blake3}) {
+		if (!is_hash_algorithm_available(algo))
+			continue;
+
+		// Single-threaded, and then one thread per CPU
+		for (unsigned threads : {1u, 0u}) {
+			hash_threads = threads;
+
+			double best = 0;
+			for (int i = 0; i < runs; i++) {
+				auto start = std::chrono::steady_clock::now();
+				hash_buffer(algo, data);
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+				best = std::max(best, size / elapsed.count() / 1e9);
+			}
+
+			fmtns::print("{0:>8} {1:>12}: {2:.2f} GB/s\n",
+				hash_algorithm_name(algo),
+				threads ? "1 thread" : "all threads", best);
+		}
+	}
+}
@@ -0,0 +1,68 @@
+/* Directory diff utility - Block maps of differing files
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <blockmap.hpp>
+#include <retry.hpp>
+#include <print.hpp>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string_view>
+#include <system_error>
+#include <unistd.h>
+
+void write_block_map(int tree, const std::string &rel, std::uint64_t a_size, std::uint64_t b_size,
+		const std::vector<block_range> &blocks) {
+	auto path = block_map_dir / std::to_string(tree) / (rel + ".blocks");
+
+	auto contents = fmtns::format("dir-diff block map\nblock-size {0}\nsizes {1} {2}\n",
+			block_map_size, a_size, b_size);
+	for (const auto &range : blocks)
+		contents += fmtns::format("{0} {1}\n", range.first, range.count);
+
+	auto report = [&] (const std::string &error) {
+		fmtns::print(std::cerr, "Failed to write block map {0}: {1}\n", path.string(), error);
+	};
+
+	std::error_code ec;
+	fs::create_directories(path.parent_path(), ec);
+	if (ec) {
+		report(ec.message());
+		return;
+	}
+
+	int fd = retry_syscall([&] { return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666); });
+	if (fd < 0) {
+		report(strerror(errno));
+		return;
+	}
+
+	std::string_view data{contents};
+	while (!data.empty()) {
+		auto ret = retry_syscall([&] { return write(fd, data.data(), data.size()); });
+		if (ret < 0) {
+			report(strerror(errno));
+			close(fd);
+			return;
+		}
+
+		data.remove_prefix(ret);
+	}
+
+	if (close(fd) < 0)
+		report(strerror(errno));
+}
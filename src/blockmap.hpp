@@ -0,0 +1,44 @@
+/* Directory diff utility - Block maps of differing files
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <compare.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// The blocks in which each regular file differs from the reference are
+// written to a text file of its own, at <tree>/<path>.blocks in the block map
+// directory. The file starts with a header line, followed by the block size,
+// and the sizes of the reference file and the other file:
+//
+//   dir-diff block map
+//   block-size 1048576
+//   sizes 73400320 73401000
+//
+// Every following line holds the index of the first block of a run of
+// differing blocks, and the number of blocks in it, in ascending order.
+
+inline fs::path block_map_dir;
+
+// Writes out the block map of a file, given its path relative to the roots.
+// Failures are reported, but don't stop the comparison.
+void write_block_map(int tree, const std::string &rel, std::uint64_t a_size, std::uint64_t b_size,
+		const std::vector<block_range> &blocks);
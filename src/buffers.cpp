@@ -0,0 +1,97 @@
+/* Directory diff utility - I/O buffer pool
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <buffers.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <new>
+#include <sys/mman.h>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace {
+
+std::byte *allocate(size_t size) {
+#ifdef MAP_HUGETLB
+	if (use_huge_pages) {
+		auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED)
+			return static_cast<std::byte *>(ptr);
+
+		// No huge pages reserved, fall back to transparent ones
+	}
+#endif
+
+	// Over-allocate and trim the mapping down to an aligned range
+	auto ptr = mmap(nullptr, size + buffer_granularity, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		throw std::bad_alloc{};
+
+	auto addr = reinterpret_cast<uintptr_t>(ptr);
+	auto aligned = (addr + buffer_granularity - 1) & ~(buffer_granularity - 1);
+
+	if (aligned > addr)
+		munmap(ptr, aligned - addr);
+	if (aligned + size < addr + size + buffer_granularity)
+		munmap(reinterpret_cast<void *>(aligned + size), addr + buffer_granularity - aligned);
+
+#ifdef MADV_HUGEPAGE
+	madvise(reinterpret_cast<void *>(aligned), size, MADV_HUGEPAGE);
+#endif
+
+	return reinterpret_cast<std::byte *>(aligned);
+}
+
+struct buffer_pool {
+	~buffer_pool() {
+		for (auto [data, size] : free)
+			munmap(data, size);
+	}
+
+	std::vector<std::pair<std::byte *, size_t>> free;
+};
+
+thread_local buffer_pool pool;
+
+} // namespace anonymous
+
+io_buffer::io_buffer(size_t size) {
+	size = std::max(buffer_granularity,
+			(size + buffer_granularity - 1) & ~(buffer_granularity - 1));
+
+	// Use the smallest free buffer that's large enough
+	auto best = pool.free.end();
+	for (auto it = pool.free.begin(); it != pool.free.end(); it++) {
+		if (it->second >= size && (best == pool.free.end() || it->second < best->second))
+			best = it;
+	}
+
+	if (best != pool.free.end()) {
+		std::tie(data_, size_) = *best;
+		pool.free.erase(best);
+		return;
+	}
+
+	data_ = allocate(size);
+	size_ = size;
+}
+
+io_buffer::~io_buffer() {
+	pool.free.emplace_back(data_, size_);
+}
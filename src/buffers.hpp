@@ -0,0 +1,56 @@
+/* Directory diff utility - I/O buffer pool
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <span>
+
+// Buffers are allocated in multiples of, and aligned to the size of a huge
+// page, which also satisfies the alignment requirements of O_DIRECT
+inline constexpr size_t buffer_granularity = 2 * 1024 * 1024;
+
+// Back the buffers with explicit huge pages (MAP_HUGETLB), instead of just
+// advising the kernel to use transparent huge pages for them
+inline bool use_huge_pages = false;
+
+// A buffer borrowed from the pool of the current thread, which is returned
+// to it once destroyed. Buffers are never freed before the thread exits, so
+// after the first few comparisons, no more memory is allocated.
+class io_buffer {
+public:
+	explicit io_buffer(size_t size);
+	~io_buffer();
+
+	io_buffer(const io_buffer &) = delete;
+	io_buffer &operator=(const io_buffer &) = delete;
+
+	std::byte *data() const {
+		return data_;
+	}
+
+	size_t size() const {
+		return size_;
+	}
+
+	std::span<std::byte> span() const {
+		return {data_, size_};
+	}
+
+private:
+	std::byte *data_;
+	size_t size_;
+};
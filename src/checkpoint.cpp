@@ -0,0 +1,373 @@
+/* Directory diff utility - Checkpointing of long comparisons
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <checkpoint.hpp>
+#include <serialize.hpp>
+#include <retry.hpp>
+#include <print.hpp>
+#include <compare.hpp>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+
+// Followed by the format version, whether it's a three-way diff, the roots and
+// the shard, and then by the options that change the results
+constexpr std::string_view checkpoint_magic = "dir-diff checkpoint\n";
+constexpr std::uint64_t checkpoint_version = 4;
+
+// Stored after each difference, describing where its sub-diffs come from
+constexpr std::uint64_t no_sub_diffs = 0;
+constexpr std::uint64_t recorded_sub_diffs = 1;
+constexpr std::uint64_t unwalked_sub_diffs = 2;
+
+int checkpoint_fd = -1;
+fs::path checkpoint_path;
+
+// Options the results were recorded with, following the rest of the header
+std::string options_header;
+
+// Guards the file and the records which haven't been written out yet, which
+// are written out by the thread handling interruptions as well
+std::mutex checkpoint_mutex;
+
+// Records which haven't been written out yet
+std::string pending;
+std::chrono::steady_clock::time_point last_write;
+
+// Results loaded from an earlier run, keyed by the tree and relative path of
+// the directory. The values point into loaded_contents.
+std::string loaded_contents;
+std::unordered_map<std::string, std::string_view> completed;
+
+std::system_error checkpoint_error(const char *what) {
+	return {errno, std::system_category(), checkpoint_path.string() + ": " + what};
+}
+
+std::string relative_path(const tree_entry &dir) {
+	return dir.dentry.path().string().substr(roots[dir.tree].string().size());
+}
+
+std::string record_key(int tree, std::string_view rel) {
+	std::string key;
+	write_u64(key, tree);
+	key.append(rel);
+	return key;
+}
+
+std::string make_header() {
+	std::string header{checkpoint_magic};
+	write_u64(header, checkpoint_version);
+	write_u64(header, three_way);
+
+	write_u64(header, roots.size());
+	for (const auto &root : roots)
+		write_string(header, root.native());
+
+	write_u64(header, shard_index);
+	write_u64(header, shard_count);
+	write_u64(header, shard_depth);
+
+	return header;
+}
+
+std::string make_options_header(const std::vector<std::string> &ignore_patterns,
+		const std::vector<std::string> &only_patterns) {
+	std::string header;
+	write_u64(header, paranoid);
+	write_u64(header, static_cast<std::uint64_t>(content_compare));
+	write_u64(header, static_cast<std::uint64_t>(quick_compare));
+	write_u64(header, follow_symlinks);
+	write_u64(header, one_file_system);
+	write_u64(header, lazy_depth + 1);
+
+	for (const auto *patterns : {&ignore_patterns, &only_patterns}) {
+		write_u64(header, patterns->size());
+		for (const auto &pat : *patterns)
+			write_string(header, pat);
+	}
+
+	return header;
+}
+
+void read_file(int fd) {
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		throw checkpoint_error("stat failed");
+
+	loaded_contents.resize(st.st_size);
+
+	size_t count = 0;
+	while (count < loaded_contents.size()) {
+		auto ret = retry_syscall([&] {
+			return pread(fd, loaded_contents.data() + count, loaded_contents.size() - count, count);
+		});
+		if (ret < 0)
+			throw checkpoint_error("read failed");
+		if (!ret)
+			break;
+
+		count += ret;
+	}
+
+	loaded_contents.resize(count);
+}
+
+// Loads the records from the file, and returns the size of the part of the
+// file that holds complete records
+size_t load_records() {
+	std::string_view in = loaded_contents;
+
+	auto header = make_header();
+	if (!in.starts_with(header))
+		throw corrupt_file{checkpoint_path.string() + ": not a checkpoint of the same comparison"};
+
+	in.remove_prefix(header.size());
+
+	if (!in.starts_with(options_header))
+		throw corrupt_file{checkpoint_path.string() + ": recorded with different options"
+				" (like --ignore, --only, --paranoid, --quick, --follow, --one-file-system,"
+				" --lazy-depth or --compare)"};
+
+	in.remove_prefix(options_header.size());
+
+	while (!in.empty()) {
+		auto record_start = in;
+
+		try {
+			auto record = read_string(in);
+			auto tree = read_u64(record);
+			auto rel = read_string(record);
+
+			// Later records replace earlier ones for the same directory
+			completed.insert_or_assign(record_key(tree, rel), record);
+		} catch (const corrupt_file &) {
+			// The last record may have been cut off by the interruption
+			return loaded_contents.size() - record_start.size();
+		}
+	}
+
+	return loaded_contents.size();
+}
+
+void write_pending() {
+	std::string_view data = pending;
+
+	while (!data.empty()) {
+		auto ret = retry_syscall([&] { return write(checkpoint_fd, data.data(), data.size()); });
+		if (ret < 0)
+			throw checkpoint_error("write failed");
+
+		data.remove_prefix(ret);
+	}
+
+	if (fdatasync(checkpoint_fd) < 0)
+		throw checkpoint_error("sync failed");
+
+	pending.clear();
+	last_write = std::chrono::steady_clock::now();
+}
+
+// Stops checkpointing if the file can't be written to, since the comparison
+// itself can still carry on
+void try_write_pending() {
+	try {
+		write_pending();
+	} catch (const std::system_error &err) {
+		fmtns::print(std::cerr, "Failed to write checkpoint {0}\n", err.what());
+
+		close(checkpoint_fd);
+		checkpoint_fd = -1;
+		pending.clear();
+	}
+}
+
+std::optional<std::vector<diff>> load_directory(int tree, const std::string &rel) {
+	auto it = completed.find(record_key(tree, rel));
+	if (it == completed.end())
+		return std::nullopt;
+
+	auto in = it->second;
+	std::vector<diff> diffs;
+
+	try {
+		auto n_diffs = read_u64(in);
+		for (std::uint64_t i = 0; i < n_diffs; i++) {
+			auto &diff = diffs.emplace_back(read_diff(in, roots, tree));
+
+			auto sub_diffs_state = read_u64(in);
+			if (sub_diffs_state == unwalked_sub_diffs) {
+				diff.lazy_sub_diffs = [a_path = diff.a_path] { return diff_directory(a_path); };
+				diff.lazy_walk = true;
+			} else if (sub_diffs_state == recorded_sub_diffs) {
+				auto sub_diffs = load_directory(tree, (fs::path{rel} / diff.name).string());
+				if (!sub_diffs)
+					return std::nullopt;
+
+				diff.sub_diffs = std::move(*sub_diffs);
+			}
+
+			// Directories are displayed (and walked) by their path
+			if (diff.type == diff_type::contents && has_sub_diffs(diff) && diff.a_path.empty())
+				return std::nullopt;
+		}
+	} catch (const corrupt_file &) {
+		// Walk the directory again instead
+		return std::nullopt;
+	}
+
+	return diffs;
+}
+
+// Waits for the signals that interrupt the comparison, writing out the
+// pending records before letting them terminate the process. The signals are
+// blocked in every other thread, so this runs as regular code, rather than in
+// a signal handler.
+void handle_interruptions(sigset_t signals) {
+	int sig;
+	while (sigwait(&signals, &sig))
+		;
+
+	{
+		std::lock_guard lock{checkpoint_mutex};
+		if (checkpoint_fd >= 0) {
+			try_write_pending();
+			fmtns::print(std::cerr, "\nInterrupted, the results so far can be resumed from {0}\n",
+					checkpoint_path.string());
+		}
+	}
+
+	// Terminate with the signal, as if it wasn't handled
+	std::signal(sig, SIG_DFL);
+
+	sigset_t unblock;
+	sigemptyset(&unblock);
+	sigaddset(&unblock, sig);
+	pthread_sigmask(SIG_UNBLOCK, &unblock, nullptr);
+
+	raise(sig);
+	_exit(128 + sig);
+}
+
+size_t count_errors(const std::vector<diff> &diffs) {
+	size_t count = 0;
+	for (const auto &diff : diffs)
+		count += (diff.type == diff_type::error) + count_errors(diff.sub_diffs);
+
+	return count;
+}
+
+} // namespace anonymous
+
+void open_checkpoint(const fs::path &path, bool resume,
+		const std::vector<std::string> &ignore_patterns, const std::vector<std::string> &only_patterns) {
+	checkpoint_path = path;
+	options_header = make_options_header(ignore_patterns, only_patterns);
+
+	int flags = O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC);
+	checkpoint_fd = retry_syscall([&] { return open(path.c_str(), flags, 0666); });
+	if (checkpoint_fd < 0)
+		throw checkpoint_error("open failed");
+
+	if (resume)
+		read_file(checkpoint_fd);
+
+	size_t valid_size = 0;
+	if (!loaded_contents.empty())
+		valid_size = load_records();
+	else
+		pending = make_header() + options_header;
+
+	// Drop any incomplete record at the end so that new ones follow the
+	// complete ones
+	if (ftruncate(checkpoint_fd, valid_size) < 0 || lseek(checkpoint_fd, valid_size, SEEK_SET) < 0)
+		throw checkpoint_error("truncate failed");
+
+	write_pending();
+
+	// Threads started from now on inherit the blocked signals, and so do
+	// child processes, which have to unblock them before running anything
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	std::thread{handle_interruptions, signals}.detach();
+}
+
+void close_checkpoint() {
+	std::lock_guard lock{checkpoint_mutex};
+
+	if (checkpoint_fd < 0)
+		return;
+
+	try_write_pending();
+
+	if (checkpoint_fd >= 0)
+		close(checkpoint_fd);
+	checkpoint_fd = -1;
+}
+
+std::optional<std::vector<diff>> load_checkpoint(const tree_entry &dir) {
+	if (completed.empty())
+		return std::nullopt;
+
+	auto diffs = load_directory(dir.tree, relative_path(dir));
+	if (diffs)
+		error_count += count_errors(*diffs);
+
+	return diffs;
+}
+
+void save_checkpoint(const tree_entry &dir, const std::vector<diff> &diffs) {
+	std::lock_guard lock{checkpoint_mutex};
+
+	if (checkpoint_fd < 0)
+		return;
+
+	std::string record;
+	write_u64(record, dir.tree);
+	write_string(record, relative_path(dir));
+
+	// The sub-diffs of directories come from their own records
+	write_u64(record, diffs.size());
+	for (const auto &diff : diffs) {
+		write_diff(record, diff);
+
+		if (diff.lazy_walk)
+			write_u64(record, unwalked_sub_diffs);
+		else
+			write_u64(record, has_sub_diffs(diff) ? recorded_sub_diffs : no_sub_diffs);
+	}
+
+	write_string(pending, record);
+
+	if (std::chrono::steady_clock::now() - last_write >= checkpoint_interval)
+		try_write_pending();
+}
@@ -0,0 +1,50 @@
+/* Directory diff utility - Checkpointing of long comparisons
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <tree.hpp>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+
+// The results for every directory are appended to the checkpoint file as
+// soon as the directory has been compared. Since directories are finished
+// before their parents, a resumed run can take the results for any directory
+// found in the file instead of walking it again.
+
+// How often the results gathered so far are written out to the file. They're
+// also written out if the process is interrupted (by SIGINT, SIGTERM or
+// SIGHUP) in the meantime.
+inline std::chrono::seconds checkpoint_interval{60};
+
+// Starts recording results into the file, after loading the results already
+// in it if resuming. Along with the paths, the options that change the
+// results (including the patterns that select the entries compared) have to
+// be the same as those of the run that recorded them. Has to be called before
+// any threads are started. Throws std::system_error or corrupt_file on
+// failure.
+void open_checkpoint(const fs::path &path, bool resume,
+		const std::vector<std::string> &ignore_patterns, const std::vector<std::string> &only_patterns);
+
+// Writes out any results that haven't been written out yet
+void close_checkpoint();
+
+// Returns the differences recorded for a directory by an earlier run
+std::optional<std::vector<diff>> load_checkpoint(const tree_entry &dir);
+
+void save_checkpoint(const tree_entry &dir, const std::vector<diff> &diffs);
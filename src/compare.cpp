@@ -0,0 +1,437 @@
+/* Directory diff utility - File contents comparison
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <compare.hpp>
+#include <buffers.hpp>
+#include <retry.hpp>
+#include <deadline.hpp>
+#include <throttle.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::optional<io_backend> parse_io_backend(std::string_view name) {
+	if (name == "stream")
+		return io_backend::stream;
+	if (name == "read")
+		return io_backend::read;
+	if (name == "mmap")
+		return io_backend::mmap;
+
+	return std::nullopt;
+}
+
+std::string_view io_backend_name(io_backend backend) {
+	switch (backend) {
+		case io_backend::stream: return "stream";
+		case io_backend::read: return "read";
+		case io_backend::mmap: return "mmap";
+	}
+
+	return "unknown";
+}
+
+namespace {
+
+std::error_code last_error() {
+	return {errno, std::generic_category()};
+}
+
+// Records that a file couldn't be read, keeping the memory of the block map
+// around for the next comparison
+void set_error(content_result &result, std::error_code ec, const fs::path &path) {
+	result.different = false;
+	result.error = ec;
+	result.error_path = path;
+	result.blocks.clear();
+}
+
+// Marks the blocks overlapping the given range of bytes as different
+void mark_blocks(std::vector<block_range> &blocks, std::uint64_t from, std::uint64_t to) {
+	if (from >= to)
+		return;
+
+	auto first = from / block_map_size;
+	auto last = (to - 1) / block_map_size;
+
+	if (!blocks.empty()) {
+		auto &prev = blocks.back();
+		auto end = prev.first + prev.count;
+		if (first <= end) {
+			prev.count = std::max(end, last + 1) - prev.first;
+			return;
+		}
+	}
+
+	blocks.push_back({first, last - first + 1});
+}
+
+// Compares the same range of two files block by block, given its offset in
+// the files, and marks the blocks which differ
+void compare_blocks(std::vector<block_range> &blocks, const std::byte *a, const std::byte *b,
+		size_t size, std::uint64_t offset) {
+	size_t pos = 0;
+	while (pos < size) {
+		// Up to the end of the block the position is in
+		auto block_end = (offset + pos) / block_map_size * block_map_size + block_map_size;
+		auto len = std::min<std::uint64_t>(size - pos, block_end - (offset + pos));
+
+		if (std::memcmp(a + pos, b + pos, len))
+			mark_blocks(blocks, offset + pos, offset + pos + len);
+
+		pos += len;
+	}
+}
+
+void compare_stream(const fs::path &a, const std::vector<fs::path> &bs, std::vector<content_result> &results) {
+	std::vector<size_t> pending;
+
+	std::ifstream a_ifs{a, std::ios::binary};
+	if (!a_ifs.is_open()) {
+		auto ec = last_error();
+		for (auto &result : results)
+			set_error(result, ec, a);
+		return;
+	}
+
+	std::vector<std::ifstream> b_ifss;
+	for (size_t i = 0; i < bs.size(); i++) {
+		auto &b_ifs = b_ifss.emplace_back(bs[i], std::ios::binary);
+		if (!b_ifs.is_open()) {
+			set_error(results[i], last_error(), bs[i]);
+			continue;
+		}
+
+		pending.push_back(i);
+	}
+
+	char a_buf[4096], b_buf[4096];
+	while (!pending.empty()) {
+		a_ifs.read(a_buf, 4096);
+		auto a_count = a_ifs.gcount();
+		throttle_read(a_count);
+
+		if (a_ifs.bad()) {
+			for (auto i : pending)
+				set_error(results[i], std::make_error_code(std::errc::io_error), a);
+			break;
+		}
+
+		for (size_t i = 0; i < pending.size();) {
+			auto &b_ifs = b_ifss[pending[i]];
+			b_ifs.read(b_buf, 4096);
+			auto b_count = b_ifs.gcount();
+			throttle_read(b_count);
+
+			if (b_ifs.bad()) {
+				results[pending[i]] = {false, std::make_error_code(std::errc::io_error), bs[pending[i]]};
+				pending.erase(pending.begin() + i);
+				continue;
+			}
+
+			if (std::string_view{a_buf, static_cast<size_t>(a_count)} !=
+					std::string_view{b_buf, static_cast<size_t>(b_count)}) {
+				results[pending[i]].different = true;
+				pending.erase(pending.begin() + i);
+				continue;
+			}
+
+			i++;
+		}
+
+		if (a_count < 4096)
+			break;
+	}
+
+}
+
+// Large enough to amortize the cost of the syscalls, and to be backed by a
+// single huge page
+constexpr size_t chunk_size = buffer_granularity;
+
+// Reads until the buffer is full or the end of file is reached, returning
+// the amount of data read, or -1 on error
+ssize_t read_chunk(int fd, std::byte *buf, size_t size) {
+	size_t count = 0;
+	while (count < size) {
+		auto ret = retry_syscall([&] { return timed_read(fd, buf + count, size - count); });
+		if (ret < 0)
+			return -1;
+		if (!ret)
+			break;
+
+		throttle_read(ret);
+		count += ret;
+	}
+
+	return count;
+}
+
+int open_file(const fs::path &path) {
+	return retry_syscall([&] { return timed_open(path.c_str(), O_RDONLY | O_CLOEXEC); });
+}
+
+struct fd_guard {
+	explicit fd_guard(const fs::path &path)
+	: fd{open_file(path)} { }
+
+	~fd_guard() {
+		if (fd >= 0)
+			close(fd);
+	}
+
+	fd_guard(const fd_guard &) = delete;
+	fd_guard &operator=(const fd_guard &) = delete;
+
+	int fd;
+};
+
+void compare_read(const fs::path &a, const std::vector<fs::path> &bs, std::vector<content_result> &results) {
+	// One buffer for the reference, and one shared by all the other files
+	io_buffer a_buf{chunk_size}, b_buf{chunk_size};
+
+
+	// Reused across calls to avoid allocating on every comparison
+	thread_local std::vector<size_t> pending;
+	thread_local std::vector<int> b_fds;
+	pending.clear();
+	b_fds.clear();
+
+	fd_guard a_fd{a};
+	if (a_fd.fd < 0) {
+		auto ec = last_error();
+		for (auto &result : results)
+			set_error(result, ec, a);
+		return;
+	}
+
+	posix_fadvise(a_fd.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	for (size_t i = 0; i < bs.size(); i++) {
+		int fd = open_file(bs[i]);
+		b_fds.push_back(fd);
+
+		if (fd < 0) {
+			set_error(results[i], last_error(), bs[i]);
+			continue;
+		}
+
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		pending.push_back(i);
+	}
+
+	std::uint64_t offset = 0;
+
+	while (!pending.empty()) {
+		auto a_count = read_chunk(a_fd.fd, a_buf.data(), chunk_size);
+		if (a_count < 0) {
+			auto ec = last_error();
+			for (auto i : pending)
+				set_error(results[i], ec, a);
+			pending.clear();
+			break;
+		}
+
+		for (size_t i = 0; i < pending.size();) {
+			auto b_count = read_chunk(b_fds[pending[i]], b_buf.data(), chunk_size);
+
+			if (b_count < 0) {
+				results[pending[i]] = {false, last_error(), bs[pending[i]]};
+				pending.erase(pending.begin() + i);
+				continue;
+			}
+
+			if (block_map_size) {
+				// Keep reading to the end, to map all the differing blocks
+				auto &blocks = results[pending[i]].blocks;
+				auto common = std::min(a_count, b_count);
+
+				compare_blocks(blocks, a_buf.data(), b_buf.data(), common, offset);
+				mark_blocks(blocks, offset + common, offset + std::max(a_count, b_count));
+			} else if (b_count != a_count || std::memcmp(a_buf.data(), b_buf.data(), a_count)) {
+				results[pending[i]].different = true;
+				pending.erase(pending.begin() + i);
+				continue;
+			}
+
+			i++;
+		}
+
+		offset += a_count;
+
+		if (static_cast<size_t>(a_count) < chunk_size)
+			break;
+	}
+
+	// Whatever is past the end of the reference is only in the other files
+	if (block_map_size) {
+		for (auto i : pending) {
+			auto &result = results[i];
+
+			struct stat st;
+			if (retry_syscall([&] { return timed_fstat(b_fds[i], &st); }) < 0) {
+				set_error(result, last_error(), bs[i]);
+				continue;
+			}
+
+			mark_blocks(result.blocks, offset, st.st_size);
+			result.different = !result.blocks.empty();
+		}
+	}
+
+	for (auto fd : b_fds) {
+		if (fd >= 0)
+			close(fd);
+	}
+
+}
+
+struct file_mapping {
+	explicit file_mapping(const fs::path &path) {
+		fd_guard fd{path};
+		if (fd.fd < 0) {
+			error = last_error();
+			return;
+		}
+
+		struct stat st;
+		if (retry_syscall([&] { return timed_fstat(fd.fd, &st); }) < 0) {
+			error = last_error();
+			return;
+		}
+
+		size = st.st_size;
+
+		// Empty files can't be mapped, but there's nothing to compare anyway
+		if (!size)
+			return;
+
+		auto ptr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.fd, 0);
+		if (ptr == MAP_FAILED) {
+			error = last_error();
+			return;
+		}
+
+		data = static_cast<const std::byte *>(ptr);
+		madvise(ptr, size, MADV_SEQUENTIAL);
+	}
+
+	~file_mapping() {
+		if (data)
+			munmap(const_cast<std::byte *>(data), size);
+	}
+
+	file_mapping(const file_mapping &) = delete;
+	file_mapping &operator=(const file_mapping &) = delete;
+
+	const std::byte *data = nullptr;
+	size_t size = 0;
+	std::error_code error;
+};
+
+void compare_mmap(const fs::path &a, const std::vector<fs::path> &bs, std::vector<content_result> &results) {
+	std::vector<size_t> pending;
+
+	file_mapping a_map{a};
+	if (a_map.error) {
+		for (auto &result : results)
+			set_error(result, a_map.error, a);
+		return;
+	}
+
+	std::vector<std::unique_ptr<file_mapping>> b_maps;
+	for (size_t i = 0; i < bs.size(); i++) {
+		auto &b_map = b_maps.emplace_back(std::make_unique<file_mapping>(bs[i]));
+		if (b_map->error) {
+			set_error(results[i], b_map->error, bs[i]);
+			continue;
+		}
+
+		if (b_map->size != a_map.size && !block_map_size) {
+			results[i].different = true;
+			continue;
+		}
+
+		pending.push_back(i);
+	}
+
+	// Walk the mappings in chunks, so that every chunk of the reference is
+	// compared against all the other files while it's still in the cache
+	for (size_t offset = 0; offset < a_map.size && !pending.empty(); offset += chunk_size) {
+		auto size = std::min(chunk_size, a_map.size - offset);
+
+		// The mappings are read as they're compared
+		throttle_read(size);
+
+		std::erase_if(pending, [&] (size_t i) {
+			throttle_read(std::min(size, b_maps[i]->size - std::min(offset, b_maps[i]->size)));
+
+			if (block_map_size) {
+				// Keep going to the end, to map all the differing blocks
+				auto common = std::min(size, b_maps[i]->size - std::min(offset, b_maps[i]->size));
+
+				compare_blocks(results[i].blocks, a_map.data + offset, b_maps[i]->data + offset, common, offset);
+				return false;
+			}
+
+			if (!std::memcmp(a_map.data + offset, b_maps[i]->data + offset, size))
+				return false;
+
+			results[i].different = true;
+			return true;
+		});
+	}
+
+	// Whatever is past the end of the shorter file is only in the longer one
+	for (auto i : pending) {
+		auto &result = results[i];
+
+		mark_blocks(result.blocks, std::min(a_map.size, b_maps[i]->size), std::max(a_map.size, b_maps[i]->size));
+		result.different = !result.blocks.empty();
+	}
+
+}
+
+} // namespace anonymous
+
+void are_contents_different(const fs::path &a, const std::vector<fs::path> &bs, std::vector<content_result> &results) {
+	// The results are reset rather than replaced, so that the memory of the
+	// paths and block maps in them is reused
+	results.resize(bs.size());
+	for (auto &result : results) {
+		result.different = false;
+		result.error.clear();
+		result.error_path.clear();
+		result.blocks.clear();
+	}
+
+	switch (compare_io) {
+		case io_backend::stream: compare_stream(a, bs, results); return;
+		case io_backend::read: compare_read(a, bs, results); return;
+		case io_backend::mmap: compare_mmap(a, bs, results); return;
+	}
+
+	for (auto &result : results)
+		result.different = true;
+}
@@ -0,0 +1,74 @@
+/* Directory diff utility - File contents comparison
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+enum class io_backend {
+	// std::ifstream, with its own buffering
+	stream,
+	// Plain read(2) into buffers from the I/O buffer pool
+	read,
+	// mmap(2) both files and compare the mappings
+	mmap
+};
+
+// read is the default, as it doesn't copy the data into a buffer of its own
+// like stream does, and it's the only backend that works with --timeout and
+// computes block maps (along with mmap)
+inline io_backend compare_io = io_backend::read;
+
+// Size of the blocks whose differences are mapped while comparing files
+// (0 meaning that no block maps are computed, and files stop being read as
+// soon as they're found to be different)
+inline std::uint64_t block_map_size = 0;
+
+// A run of consecutive blocks
+struct block_range {
+	std::uint64_t first, count;
+};
+
+std::optional<io_backend> parse_io_backend(std::string_view name);
+std::string_view io_backend_name(io_backend backend);
+
+struct content_result {
+	bool different = false;
+
+	// Set if either of the files couldn't be read, in which case it's
+	// unknown whether they're different
+	std::error_code error = {};
+	fs::path error_path = {};
+
+	// With block maps, the blocks in which the files differ (including the
+	// ones only in the longer of the files), in ascending order
+	std::vector<block_range> blocks = {};
+};
+
+// Compares the contents of the reference file against each of the other
+// files in lockstep, reading the reference only once. Leaves whether each of
+// the other files is different in results, which are reused from the previous
+// call so that comparing allocates nothing once the buffers have grown. With
+// block maps, the files are read to the end even if they're different, which
+// requires the read or mmap backend.
+void are_contents_different(const fs::path &a, const std::vector<fs::path> &bs, std::vector<content_result> &results);
@@ -0,0 +1,219 @@
+/* Directory diff utility - Deadlines for filesystem operations
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <deadline.hpp>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+// Shared by the worker thread and the thread handing it jobs, so that it
+// outlives whichever of them stops using it first
+struct worker_state {
+	std::mutex mutex;
+	std::condition_variable cv;
+
+	std::function<void()> job;
+	bool done = false;
+
+	// Set once no more jobs are going to be handed to the worker
+	bool abandoned = false;
+};
+
+void work(std::shared_ptr<worker_state> state) {
+	std::unique_lock lock{state->mutex};
+
+	while (true) {
+		state->cv.wait(lock, [&] { return state->job || state->abandoned; });
+		if (!state->job)
+			return;
+
+		auto job = std::move(state->job);
+		state->job = nullptr;
+
+		lock.unlock();
+		job();
+		lock.lock();
+
+		state->done = true;
+		state->cv.notify_all();
+
+		if (state->abandoned)
+			return;
+	}
+}
+
+// A thread running jobs one at a time, which is reused until it gets stuck
+class worker {
+public:
+	worker()
+	: state_{std::make_shared<worker_state>()} {
+		std::thread{work, state_}.detach();
+	}
+
+	~worker() {
+		std::lock_guard lock{state_->mutex};
+		state_->abandoned = true;
+		state_->cv.notify_all();
+	}
+
+	worker(const worker &) = delete;
+	worker &operator=(const worker &) = delete;
+
+	bool run(std::function<void()> job) {
+		std::unique_lock lock{state_->mutex};
+		state_->job = std::move(job);
+		state_->done = false;
+		state_->cv.notify_all();
+
+		return state_->cv.wait_for(lock, operation_timeout, [&] { return state_->done; });
+	}
+
+private:
+	std::shared_ptr<worker_state> state_;
+};
+
+thread_local std::unique_ptr<worker> current_worker;
+
+} // namespace anonymous
+
+bool run_with_deadline(std::function<void()> job) {
+	if (!current_worker)
+		current_worker = std::make_unique<worker>();
+
+	if (current_worker->run(std::move(job)))
+		return true;
+
+	// Leave the worker blocked in the job, and start a new one next time
+	current_worker.reset();
+	return false;
+}
+
+int timed_open(const char *path, int flags) {
+	if (operation_timeout == std::chrono::milliseconds::zero())
+		return open(path, flags);
+
+	// A file opened after the caller gave up on it would never be closed,
+	// so whichever of the job and the caller finds out the other is done
+	// last closes it
+	struct open_state {
+		std::mutex mutex;
+		int fd = -1;
+		bool abandoned = false;
+	};
+
+	auto state = std::make_shared<open_state>();
+
+	auto ret = call_with_deadline([path = std::string{path}, flags, state] {
+		int fd = open(path.c_str(), flags);
+
+		std::lock_guard lock{state->mutex};
+		if (state->abandoned) {
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+
+		state->fd = fd;
+		return fd;
+	});
+
+	if (!ret) {
+		std::lock_guard lock{state->mutex};
+		state->abandoned = true;
+
+		// Opened just too late for the deadline
+		if (state->fd >= 0) {
+			close(state->fd);
+			errno = ETIMEDOUT;
+		}
+
+		return -1;
+	}
+
+	return *ret;
+}
+
+namespace {
+
+int timed_stat_with(int (*stat_fn)(const char *, struct stat *), const char *path, struct stat *st) {
+	auto ret = call_with_deadline([stat_fn, path = std::string{path}] {
+		struct stat st;
+		int ret = stat_fn(path.c_str(), &st);
+		return std::pair{ret, st};
+	});
+
+	if (!ret)
+		return -1;
+
+	*st = ret->second;
+	return ret->first;
+}
+
+} // namespace anonymous
+
+int timed_stat(const char *path, struct stat *st) {
+	return timed_stat_with(stat, path, st);
+}
+
+int timed_lstat(const char *path, struct stat *st) {
+	return timed_stat_with(lstat, path, st);
+}
+
+int timed_fstat(int fd, struct stat *st) {
+	auto ret = call_with_deadline([fd] {
+		struct stat st;
+		int ret = fstat(fd, &st);
+		return std::pair{ret, st};
+	});
+
+	if (!ret)
+		return -1;
+
+	*st = ret->second;
+	return ret->first;
+}
+
+ssize_t timed_read(int fd, void *buf, size_t size) {
+	if (operation_timeout == std::chrono::milliseconds::zero())
+		return read(fd, buf, size);
+
+	// The data is read into a buffer owned by the job, and copied out once
+	// it's done
+	thread_local auto bounce = std::make_shared<std::vector<std::byte>>();
+	if (bounce->size() < size)
+		bounce->resize(size);
+
+	auto ret = call_with_deadline([fd, size, data = bounce] {
+		return read(fd, data->data(), size);
+	});
+
+	if (!ret) {
+		// Still being read into by the abandoned job
+		bounce = std::make_shared<std::vector<std::byte>>();
+		return -1;
+	}
+
+	if (*ret > 0)
+		std::memcpy(buf, bounce->data(), *ret);
+	return *ret;
+}
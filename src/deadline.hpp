@@ -0,0 +1,68 @@
+/* Directory diff utility - Deadlines for filesystem operations
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Filesystem operations which may block forever (like on a hung network
+// filesystem) can be given a deadline. They're then handed to a worker thread,
+// and if they don't complete in time, the worker is abandoned, still blocked
+// in the operation, and the operation fails with ETIMEDOUT. Whatever the
+// operation writes to has to be owned by it, rather than by the caller.
+
+// Longest time a single operation may take (0 meaning no limit)
+inline std::chrono::milliseconds operation_timeout{0};
+
+// Runs the job on the worker of the calling thread, returning false if it
+// didn't complete within the timeout
+bool run_with_deadline(std::function<void()> job);
+
+// Calls fn, with a deadline if there's a timeout. Returns whatever fn returned
+// with errno as fn left it, or std::nullopt with errno set to ETIMEDOUT.
+template <typename Fn>
+std::optional<std::invoke_result_t<Fn>> call_with_deadline(Fn fn) {
+	if (operation_timeout == std::chrono::milliseconds::zero())
+		return fn();
+
+	// Owned by the job, since it may outlive the call
+	auto result = std::make_shared<std::optional<std::invoke_result_t<Fn>>>();
+	auto err = std::make_shared<int>(0);
+
+	if (!run_with_deadline([fn = std::move(fn), result, err] { *result = fn(); *err = errno; })) {
+		errno = ETIMEDOUT;
+		return std::nullopt;
+	}
+
+	errno = *err;
+	return std::move(*result);
+}
+
+// Like the syscalls of the same names, failing with ETIMEDOUT if they don't
+// complete within the timeout
+int timed_open(const char *path, int flags);
+int timed_stat(const char *path, struct stat *st);
+int timed_lstat(const char *path, struct stat *st);
+int timed_fstat(int fd, struct stat *st);
+ssize_t timed_read(int fd, void *buf, size_t size);
@@ -0,0 +1,309 @@
+/* Directory diff utility - Content hashing
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <hash.hpp>
+#include <buffers.hpp>
+#include <retry.hpp>
+#include <deadline.hpp>
+#include <throttle.hpp>
+#include <config.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <stop_token>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <xxhash.h>
+#if __has_include(<xxh_x86dispatch.h>)
+// Selects the widest SIMD implementation supported by the CPU at runtime
+#include <xxh_x86dispatch.h>
+#endif
+
+#if HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
+std::optional<hash_algorithm> parse_hash_algorithm(std::string_view name) {
+	if (name == "xxh3" || name == "xxh128")
+		return hash_algorithm::xxh3;
+	if (name == "blake3")
+		return hash_algorithm::blake3;
+
+	return std::nullopt;
+}
+
+std::string_view hash_algorithm_name(hash_algorithm algo) {
+	switch (algo) {
+		case hash_algorithm::xxh3: return "xxh3";
+		case hash_algorithm::blake3: return "blake3";
+	}
+
+	return "unknown";
+}
+
+bool is_hash_algorithm_available(hash_algorithm algo) {
+	switch (algo) {
+		case hash_algorithm::xxh3: return true;
+		case hash_algorithm::blake3: return HAVE_BLAKE3;
+	}
+
+	return false;
+}
+
+namespace {
+
+// The digests of the segments and the one combining them are computed in
+// different ways, so that data which happens to consist of the digests of
+// some segments doesn't hash the same as the file they come from
+enum class hash_domain {
+	segment, combined
+};
+
+// Seed of XXH3 for the combined digests (the digests of segments being
+// unseeded, like those of data hashed as-is)
+constexpr XXH64_hash_t combined_seed = 0x6469722d64696666;
+
+#if HAVE_BLAKE3
+// Context of BLAKE3's key derivation mode, which the combined digests are
+// computed in, separately from its regular hashing mode
+constexpr const char *combined_context = "dir-diff 2022 combined segment digests";
+#endif
+
+digest hash_segment(hash_algorithm algo, hash_domain domain, std::span<const std::byte> data) {
+	digest out;
+
+	switch (algo) {
+		case hash_algorithm::xxh3: {
+			auto seed = domain == hash_domain::combined ? combined_seed : 0;
+
+			XXH128_canonical_t canon;
+			XXH128_canonicalFromHash(&canon, XXH3_128bits_withSeed(data.data(), data.size(), seed));
+
+			std::memcpy(out.bytes.data(), canon.digest, sizeof(canon.digest));
+			out.size = sizeof(canon.digest);
+			break;
+		}
+		case hash_algorithm::blake3: {
+#if HAVE_BLAKE3
+			blake3_hasher hasher;
+			if (domain == hash_domain::combined)
+				blake3_hasher_init_derive_key(&hasher, combined_context);
+			else
+				blake3_hasher_init(&hasher);
+			blake3_hasher_update(&hasher, data.data(), data.size());
+			blake3_hasher_finalize(&hasher, out.bytes.data(), BLAKE3_OUT_LEN);
+			out.size = BLAKE3_OUT_LEN;
+#else
+			assert(!"BLAKE3 support is not available");
+#endif
+			break;
+		}
+	}
+
+	return out;
+}
+
+unsigned thread_count() {
+	if (!hash_in_parallel)
+		return 1;
+	if (hash_threads)
+		return hash_threads;
+
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Threads hashing segments alongside the thread hashing a file, which are
+// kept around from one file to the next
+class hash_pool {
+public:
+	// Calls fn with every index below n, on up to n threads including the
+	// calling one, and returns once all of the calls are done
+	void run(size_t n, const std::function<void(size_t)> &fn) {
+		std::lock_guard run_lock{run_mutex_};
+		std::unique_lock lock{mutex_};
+
+		while (workers_.size() + 1 < n)
+			workers_.emplace_back([this, seen = generation_] (std::stop_token stop) {
+				work(stop, seen);
+			});
+
+		fn_ = &fn;
+		n_ = n;
+		next_ = 0;
+		pending_ = n;
+		generation_++;
+		wake_.notify_all();
+
+		take(lock);
+		done_.wait(lock, [&] { return !pending_; });
+		fn_ = nullptr;
+	}
+
+private:
+	// Makes the calls of the current run until there are none left
+	void take(std::unique_lock<std::mutex> &lock) {
+		while (next_ < n_) {
+			auto i = next_++;
+
+			lock.unlock();
+			(*fn_)(i);
+			lock.lock();
+
+			if (!--pending_)
+				done_.notify_all();
+		}
+	}
+
+	void work(std::stop_token stop, uint64_t seen) {
+		std::unique_lock lock{mutex_};
+
+		while (wake_.wait(lock, stop, [&] { return generation_ != seen; })) {
+			seen = generation_;
+			take(lock);
+		}
+	}
+
+	// Only one file is hashed by the pool at a time
+	std::mutex run_mutex_;
+
+	std::mutex mutex_;
+	std::condition_variable_any wake_;
+	std::condition_variable done_;
+
+	const std::function<void(size_t)> *fn_ = nullptr;
+	size_t n_ = 0, next_ = 0, pending_ = 0;
+	uint64_t generation_ = 0;
+
+	// Destroyed first, stopping the threads before the rest goes away
+	std::vector<std::jthread> workers_;
+};
+
+hash_pool pool;
+
+// Hashes every segment of data, spreading them across threads, and appends
+// their digests to leaves
+void hash_segments(hash_algorithm algo, std::span<const std::byte> data, std::vector<digest> &leaves) {
+	size_t n_segments = std::max<size_t>(1, (data.size() + hash_segment_size - 1) / hash_segment_size);
+	size_t first = leaves.size();
+	leaves.resize(first + n_segments);
+
+	auto work = [&] (size_t start, size_t stride) {
+		for (size_t i = start; i < n_segments; i += stride) {
+			auto offset = i * hash_segment_size;
+			auto size = std::min(hash_segment_size, data.size() - offset);
+
+			leaves[first + i] = hash_segment(algo, hash_domain::segment, data.subspan(offset, size));
+		}
+	};
+
+	size_t n_threads = std::min<size_t>(thread_count(), n_segments);
+	if (n_threads == 1) {
+		work(0, 1);
+		return;
+	}
+
+	pool.run(n_threads, [&] (size_t i) { work(i, n_threads); });
+}
+
+digest combine_leaves(hash_algorithm algo, const std::vector<digest> &leaves) {
+	if (leaves.size() == 1)
+		return leaves.front();
+
+	std::vector<std::byte> concat;
+	for (const auto &leaf : leaves) {
+		auto bytes = std::as_bytes(std::span{leaf.bytes}).first(leaf.size);
+		concat.insert(concat.end(), bytes.begin(), bytes.end());
+	}
+
+	return hash_segment(algo, hash_domain::combined, concat);
+}
+
+} // namespace anonymous
+
+digest hash_buffer(hash_algorithm algo, std::span<const std::byte> data) {
+	std::vector<digest> leaves;
+	hash_segments(algo, data, leaves);
+
+	return combine_leaves(algo, leaves);
+}
+
+std::optional<digest> hash_file(hash_algorithm algo, const fs::path &path) {
+	int fd = retry_syscall([&] { return timed_open(path.c_str(), O_RDONLY | O_CLOEXEC); });
+	if (fd < 0)
+		return std::nullopt;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	struct stat st;
+	if (retry_syscall([&] { return timed_fstat(fd, &st); }) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return std::nullopt;
+	}
+
+	// Read as many segments at once as there are threads to hash them, but
+	// no more than the file has, nor than max_read_segments. The reads still
+	// fill whole segments, so that files which grow while being read are
+	// split the same way.
+	auto file_segments = (static_cast<size_t>(std::max<off_t>(st.st_size, 0)) + hash_segment_size - 1)
+		/ hash_segment_size;
+	auto n_segments = std::clamp<size_t>(file_segments, 1, std::min<size_t>(thread_count(), max_read_segments));
+
+	io_buffer buffer{hash_segment_size * n_segments};
+	auto buf = buffer.span().first(hash_segment_size * n_segments);
+	std::vector<digest> leaves;
+
+	while (true) {
+		size_t count = 0;
+		while (count < buf.size()) {
+			auto ret = retry_syscall([&] { return timed_read(fd, buf.data() + count, buf.size() - count); });
+			if (ret < 0) {
+				int err = errno;
+				close(fd);
+				errno = err;
+				return std::nullopt;
+			}
+
+			if (!ret)
+				break;
+
+			throttle_read(ret);
+			count += ret;
+		}
+
+		// Don't produce an extra empty segment at the end of the file,
+		// unless the whole file is empty
+		if (count || leaves.empty())
+			hash_segments(algo, buf.first(count), leaves);
+
+		if (count < buf.size())
+			break;
+	}
+
+	close(fd);
+
+	return combine_leaves(algo, leaves);
+}
@@ -0,0 +1,67 @@
+/* Directory diff utility - Content hashing
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace fs = std::filesystem;
+
+enum class hash_algorithm {
+	xxh3, blake3
+};
+
+struct digest {
+	// Large enough for the longest supported digest
+	std::array<std::uint8_t, 32> bytes = {};
+	size_t size = 0;
+
+	bool operator==(const digest &) const = default;
+};
+
+// Data is hashed in segments of this size, which are hashed in parallel
+// and combined into a single digest by hashing their digests (in a way that
+// differs from hashing the segments). Data that fits in a single segment is
+// hashed as-is.
+inline constexpr size_t hash_segment_size = 4 * 1024 * 1024;
+
+// Files are read at most this many segments at a time, which bounds the
+// buffer each thread keeps in its pool regardless of the number of CPUs
+inline constexpr size_t max_read_segments = 8;
+
+inline hash_algorithm hash_algo = hash_algorithm::xxh3;
+
+// Number of threads used to hash a single file (0 meaning one per CPU)
+inline unsigned hash_threads = 0;
+
+// Cleared on threads which hash files alongside other such threads, so that
+// each file is hashed on the thread itself rather than on hash_threads more
+inline thread_local bool hash_in_parallel = true;
+
+std::optional<hash_algorithm> parse_hash_algorithm(std::string_view name);
+std::string_view hash_algorithm_name(hash_algorithm algo);
+bool is_hash_algorithm_available(hash_algorithm algo);
+
+digest hash_buffer(hash_algorithm algo, std::span<const std::byte> data);
+
+// Returns std::nullopt with errno set if the file couldn't be read
+std::optional<digest> hash_file(hash_algorithm algo, const fs::path &path);
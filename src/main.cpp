@@ -15,16 +15,34 @@
  */
 
 #include <getopt.h>
+#include <algorithm>
 #include <array>
 #include <config.hpp>
 #include <filesystem>
 #include <iostream>
 #include <tree.hpp>
+#include <hash.hpp>
+#include <compare.hpp>
+#include <buffers.hpp>
+#include <checkpoint.hpp>
+#include <results.hpp>
+#include <tui.hpp>
+#include <top.hpp>
+#include <blockmap.hpp>
+#include <deadline.hpp>
+#include <throttle.hpp>
 #include <print.hpp>
 #include <unistd.h>
 #include <charconv>
+#include <csignal>
+#include <cstdint>
+#include <optional>
 #include <sys/wait.h>
 #include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
 #include <wildmatch/wildmatch.hpp>
 
 void display_version() {
@@ -38,8 +56,24 @@ There is NO WARRANTY, to the extent permitted by law.\n", 2022);
 }
 
 void display_help(const char *progname) {
-	fmtns::print("Usage: {0} [OPTION]... PATH PATH\n", progname);
+	fmtns::print("Usage: {0} [OPTION]... PATH PATH [PATH]...\n", progname);
+	fmtns::print("  or:  {0} [OPTION]... --base=BASE PATH PATH\n", progname);
+	fmtns::print("  or:  {0} [OPTION]... --load=FILE\n", progname);
+	fmtns::print("  or:  {0} merge [OPTION]... FILE...\n", progname);
 	fmtns::print("Compute the difference between the specified paths.\n");
+	fmtns::print("\n");
+	fmtns::print("\
+When more than two paths are given, the first one is used as the reference, and\n\
+all the other ones are compared against it in a single pass, with the reference\n\
+files being read only once.\n");
+	fmtns::print("\n");
+	fmtns::print("\
+With --base, the two paths are compared against a common base, and each change\n\
+is classified as made in only one of them, made the same way in both, or conflicting.\n");
+	fmtns::print("\n");
+	fmtns::print("\
+With merge, the results saved with --save by every shard of a comparison split with\n\
+--shard are combined and displayed as if they came from a single run.\n");
 
 	fmtns::print("\n");
 
@@ -49,9 +83,120 @@ Input control:\n\
                                   (see below for explanation of the syntax); can be specified\n\
                                   multiple times to add multiple patterns (a file being ignored\n\
                                   if any of them matches)\n\
+  --only=PATTERN                  only compare the paths that match the specified pattern (see\n\
+                                  below for explanation of the syntax), and everything inside the\n\
+                                  directories that do, only walking the directories which could\n\
+                                  have such paths inside; can be specified multiple times to add\n\
+                                  multiple patterns (a path being compared if any of them matches)\n\
+  --files-from=FILE               only compare the paths (relative to the roots) listed in FILE,\n\
+                                  separated by newlines or NULs, or in the standard input if FILE\n\
+                                  is '-', along with checking that the directories above them are\n\
+                                  directories in every tree, comparing several paths at once\n\
+  -b, --base=BASE                 perform a three-way diff of the two paths against their\n\
+                                  common base BASE\n\
+  -x, --one-file-system           don't walk directories on other filesystems than the roots of\n\
+                                  their trees (like /proc, tmpfs or network mounts)\n\
+  --show-mounts                   list the mount points which weren't walked after the diff\n\
+                                  (implies --one-file-system)\n\
+  -L, --follow                    compare whatever symlinks point to instead of their targets,\n\
+                                  walking every pair of directories only once, however many\n\
+                                  symlinks lead to it (even in a cycle)\n\
+  --compare=MODE                  compare the contents of files by reading them all at the same time\n\
+                                  (MODE being 'lockstep', the default), or by hashing them one after\n\
+                                  another and comparing the digests (MODE being 'hash'), which reads\n\
+                                  each file sequentially, once\n\
+  --io=BACKEND                    read files with plain read(2) calls into reusable huge page\n\
+                                  aligned buffers (BACKEND being 'read', the default), through\n\
+                                  std::ifstream (BACKEND being 'stream'), or by mapping them into\n\
+                                  memory (BACKEND being 'mmap') when comparing them in lockstep\n\
+  --huge-pages                    back the I/O buffers with explicit huge pages (MAP_HUGETLB),\n\
+                                  falling back to transparent huge pages if none are available\n\
+  --order=ORDER                   process the entries of each directory in ascending inode order\n\
+                                  (ORDER being 'inode'), or regular files in the order of the\n\
+                                  physical location of their contents, followed by everything else\n\
+                                  in inode order (ORDER being 'physical'), to minimize seeking on\n\
+                                  rotational disks; by default entries are processed in the order\n\
+                                  they're listed in (ORDER being 'none'); the ordering is per\n\
+                                  directory, each directory being finished before the next\n\
+  --quick=CRITERION               tell whether regular files differ without reading them, only by\n\
+                                  comparing their sizes (CRITERION being 'size'), or their sizes and\n\
+                                  modification times, like rsync's quick check (CRITERION being\n\
+                                  'mtime'); the criterion that flagged each file is displayed\n\
+  --lazy-depth=DEPTH              only check whether the directories DEPTH or more levels deep\n\
+                                  differ (1 being the entries of the roots), stopping at the first\n\
+                                  difference, and compare their contents once they're displayed\n\
+                                  or opened; with --save, they're compared when the results are\n\
+                                  loaded instead\n\
+  --block-map=DIR                 write the blocks in which each differing regular file differs from\n\
+                                  the reference to DIR/TREE/PATH.blocks, mapping them in the same\n\
+                                  pass as the comparison, which reads the files to the end\n\
+  --block-size=SIZE               use blocks of SIZE bytes (optionally followed by K, M or G) for\n\
+                                  --block-map (1M by default)\n\
+  --prefetch                      ask the kernel to start reading the files that are going to be\n\
+                                  compared next while the current ones are being compared, with\n\
+                                  the amount of data read ahead adapting to the compare throughput\n\
+  -k, --keep-going                report entries that can't be read as errors and carry on,\n\
+                                  instead of stopping at the first such entry\n\
+  --timeout=SECONDS               give up on any filesystem operation (like reading a chunk of a\n\
+                                  file, or listing a directory) that takes longer than SECONDS,\n\
+                                  as on a hung network filesystem, reporting the entry as an error\n\
+                                  and carrying on (implies --keep-going)\n\
   --paranoid                      check file contents even if files appear to be obviously different\n\
                                   or same, ie. if the sizes differ or if it's the same inode on the\n\
-                                  same device\n");
+                                  same device (which also makes such directories be walked)\n");
+
+	fmtns::print("\n");
+
+	fmtns::print("\
+Hashing:\n\
+  --hash=ALGO                     use the specified hash algorithm for hash-based features\n\
+                                  (like --compare=hash),\n\
+                                  ALGO being 'xxh3' (XXH3-128, the default) or 'blake3';\n\
+                                  large files are hashed in segments using all CPUs\n");
+
+	fmtns::print("\n");
+
+	fmtns::print("\
+Resource usage:\n\
+  --nice=ADJUSTMENT               add ADJUSTMENT to the niceness of the process, like nice(1)\n\
+  --ioprio=CLASS[:LEVEL]          set the I/O scheduling class of the process, like ionice(1),\n\
+                                  CLASS being 'idle' (only use the disk when nothing else does)\n\
+                                  or 'best-effort', with LEVEL from 0 (highest) to 7 (4 by default)\n\
+  --bwlimit=RATE                  read file contents at no more than RATE bytes (optionally\n\
+                                  followed by K, M or G) per second, across all the trees\n");
+
+	fmtns::print("\n");
+
+	fmtns::print("\
+Checkpointing:\n\
+  --checkpoint=FILE               record the results for every directory in FILE as soon as it's\n\
+                                  been compared, so that the comparison can be resumed with --resume\n\
+                                  if it's interrupted\n\
+  --resume=FILE                   take the results for the directories recorded in FILE by an earlier\n\
+                                  run with the same paths and options instead of comparing them again,\n\
+                                  and keep recording new results in it\n\
+  --checkpoint-interval=SECONDS   write the recorded results out to the file at most every SECONDS\n\
+                                  seconds (60 by default), and when interrupted\n");
+
+	fmtns::print("\n");
+
+	fmtns::print("\
+Sharding:\n\
+  --shard=K/N                     only compare the K-th of N disjoint slices of the trees, so that\n\
+                                  N processes (on one or more hosts) can each compare one of them;\n\
+                                  entries are assigned to slices by the hash of their path\n\
+  --shard-depth=DEPTH             assign the entries DEPTH levels deep to slices (1 by default,\n\
+                                  being the entries of the roots); the directories above them are\n\
+                                  walked by every shard\n");
+
+	fmtns::print("\n");
+
+	fmtns::print("\
+Saved results:\n\
+  --save=FILE                     save the results to FILE in a compact binary format, for\n\
+                                  displaying them again with --load, or combining them with merge\n\
+  --load=FILE                     display the results saved in FILE instead of comparing any paths,\n\
+                                  only reading the parts of the file that are displayed\n");
 
 	fmtns::print("\n");
 
@@ -72,7 +217,15 @@ Output control:\n\
   -P, --no-default-prune          do not add default prune patterns (\".git\" and \"**/.git\") to the\n\
                                   prune list\n\
   -m, --max-depth=DEPTH           do not show any inner differences of directories past the specified\n\
-                                  depth (depth 0 pruning the '<root>' node itself)\n");
+                                  depth (depth 0 pruning the '<root>' node itself)\n\
+  --summary=THRESHOLD             display directories with more than THRESHOLD differences inside\n\
+                                  as a single line with the numbers of added, removed and changed\n\
+                                  entries in them and their total size, instead of listing them\n\
+  --top=N                         only display the N largest differing files and directories, by the\n\
+                                  total size of what differs in them, keeping track of only those\n\
+                                  while comparing instead of all differences\n\
+  --interactive                   browse the differences in the terminal instead of printing them,\n\
+                                  opening directories on demand and searching for PATTERNs\n");
 
 	fmtns::print("\n");
 
@@ -92,12 +245,80 @@ recursively, as described in bash(1).\n");
 	fmtns::print("\n");
 }
 
+// Parses a number of bytes, optionally followed by a binary unit
+std::optional<std::uint64_t> parse_size(std::string_view str) {
+	std::uint64_t value;
+	auto out = std::from_chars(str.data(), str.data() + str.size(), value);
+	if (out.ec != std::errc{})
+		return std::nullopt;
+
+	std::string_view unit{out.ptr, str.data() + str.size()};
+	int shift = 0;
+	if (unit == "K" || unit == "KiB")
+		shift = 10;
+	else if (unit == "M" || unit == "MiB")
+		shift = 20;
+	else if (unit == "G" || unit == "GiB")
+		shift = 30;
+	else if (!unit.empty())
+		return std::nullopt;
+
+	if (value > (UINT64_MAX >> shift))
+		return std::nullopt;
+
+	return value << shift;
+}
+
+// Reads a list of paths relative to the roots, separated by NULs if there are
+// any, or newlines otherwise, from a file (or the standard input, if it's
+// "-"). Returns them sorted and without duplicates.
+std::vector<std::string> read_path_list(const char *file) {
+	std::string data;
+	if (std::string_view{file} == "-") {
+		data.assign(std::istreambuf_iterator<char>{std::cin}, {});
+	} else {
+		std::ifstream ifs{file, std::ios::binary};
+		if (!ifs.is_open())
+			throw std::runtime_error{fmtns::format("{0}: {1}", file, strerror(errno))};
+
+		data.assign(std::istreambuf_iterator<char>{ifs}, {});
+	}
+
+	char separator = data.find('\0') != std::string::npos ? '\0' : '\n';
+
+	std::vector<std::string> paths;
+	size_t start = 0;
+	while (start < data.size()) {
+		auto end = std::min(data.find(separator, start), data.size());
+		auto path = fs::path{data.substr(start, end - start)}.lexically_normal();
+		start = end + 1;
+
+		if (path.empty())
+			continue;
+
+		// "dir/" is the same as "dir"
+		if (!path.has_filename())
+			path = path.parent_path();
+
+		if (path.is_absolute() || path == "." || *path.begin() == "..")
+			throw std::runtime_error{fmtns::format("{0}: not a path inside the roots", path.string())};
+
+		paths.push_back(path.string());
+	}
+
+	std::ranges::sort(paths);
+	paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+	return paths;
+}
+
 int progress_step = 0;
+
+// The listed paths are compared on several threads at once
+std::mutex progress_mutex;
 const std::array<std::string, 8> progress_strs{
 	"|", "/", "-", "\\", "|", "/", "-", "\\"
 };
 
-fs::path root1, root2;
 bool run_quietly = false;
 std::vector<std::string> ignore_patterns;
 std::vector<std::string> prune_patterns;
@@ -105,8 +326,8 @@ std::vector<std::string> default_prune_patterns = {".git", "**/.git"};
 
 int max_depth = -1;
 
-bool should_ignore_file(const fs::path &path, bool a_path) {
-	auto str = path.string().substr((a_path ? root1 : root2).string().size());
+bool should_ignore_file(const fs::path &path, int tree) {
+	auto str = path.string().substr(roots[tree].string().size());
 
 	for (const auto &pat : ignore_patterns) {
 		if (wild::match(pat.c_str(), str.c_str()))
@@ -116,11 +337,92 @@ bool should_ignore_file(const fs::path &path, bool a_path) {
 	return false;
 }
 
+std::vector<std::string> only_patterns;
+
+bool is_only_included(const fs::path &dir, int tree) {
+	if (only_patterns.empty())
+		return true;
+
+	auto str = dir.string().substr(roots[tree].string().size());
+	if (str.ends_with('/'))
+		str.pop_back();
+
+	// Check the directory itself and every directory above it
+	for (size_t end = str.find('/'); !str.empty(); end = str.find('/', end + 1)) {
+		auto prefix = str.substr(0, end);
+		for (const auto &pat : only_patterns) {
+			if (wild::match(pat.c_str(), prefix.c_str()))
+				return true;
+		}
+
+		if (end == std::string::npos)
+			break;
+	}
+
+	return false;
+}
+
+namespace {
+
+std::vector<std::string> split_path(std::string_view str) {
+	std::vector<std::string> components;
+
+	size_t start = 0;
+	while (true) {
+		auto end = str.find('/', start);
+		components.emplace_back(str.substr(start, end - start));
+		if (end == std::string_view::npos)
+			break;
+		start = end + 1;
+	}
+
+	return components;
+}
+
+// Checks whether the path matches the beginning of the pattern, so that paths
+// under it could match the whole pattern
+bool could_contain_match(const std::string &pat, const std::vector<std::string> &path) {
+	auto pat_components = split_path(pat);
+
+	for (size_t i = 0; i < path.size(); i++) {
+		if (i == pat_components.size())
+			return false;
+
+		// Matches any number of components from here on
+		if (pat_components[i].find("**") != std::string::npos)
+			return true;
+
+		if (!wild::match(pat_components[i].c_str(), path[i].c_str()))
+			return false;
+	}
+
+	return true;
+}
+
+} // namespace anonymous
+
+only_match match_only(const fs::path &path, int tree) {
+	auto str = path.string().substr(roots[tree].string().size());
+
+	for (const auto &pat : only_patterns) {
+		if (wild::match(pat.c_str(), str.c_str()))
+			return only_match::full;
+	}
+
+	auto components = split_path(str);
+	for (const auto &pat : only_patterns) {
+		if (could_contain_match(pat, components))
+			return only_match::partial;
+	}
+
+	return only_match::none;
+}
+
 bool should_prune_diff(const diff &diff, int depth) {
 	if (max_depth >= 0 && depth > (max_depth - 1))
 		return true;
 
-	auto str = diff.a_path.string().substr(root1.string().size());
+	auto str = diff.a_path.string().substr(roots[0].string().size());
 
 	for (const auto &pat : prune_patterns) {
 		if (wild::match(pat.c_str(), str.c_str()))
@@ -137,6 +439,7 @@ const char *ansi_red = "\x1b[31m";
 const char *ansi_green = "\x1b[32m";
 const char *ansi_yellow = "\x1b[33m";
 const char *ansi_blue = "\x1b[34m";
+const char *ansi_magenta = "\x1b[35m";
 const char *ansi_clear_to_beginning_of_line = "\x1b[2K\x1b[G";
 bool using_color = true;
 
@@ -145,14 +448,16 @@ void print_in_color(const char *color, fmtns::format_string<Args...> fmt, Args &
 	fmtns::print("{0}{1}{2}", color, fmtns::format(fmt, std::forward<Args>(args)...), ansi_reset);
 }
 
-void update_progress(const fs::path &path) {
+void update_progress(const fs::path &path, int tree) {
 	if (run_quietly || !using_color)
 		return;
 
+	std::lock_guard lock{progress_mutex};
+
 	const auto &indicator = progress_strs[progress_step];
 	progress_step = (progress_step + 1) % progress_strs.size();
 
-	std::string path_str = path.string().substr(root1.string().size());
+	std::string path_str = path.string().substr(roots[tree].string().size());
 
 	constexpr int width = 72;
 
@@ -172,6 +477,12 @@ void generate_git_diff(const fs::path &a, const fs::path &b) {
 				a.filename().string(),
 				fs::hash_value(a), fs::hash_value(b));
 
+		// Signals blocked to flush the checkpoint when interrupted would
+		// stay blocked in git otherwise, which couldn't be interrupted then
+		sigset_t signals;
+		sigemptyset(&signals);
+		pthread_sigmask(SIG_SETMASK, &signals, nullptr);
+
 		execlp("git",
 			"git", "-P",
 			"diff",
@@ -194,39 +505,188 @@ void generate_git_diff(const fs::path &a, const fs::path &b) {
 	}
 }
 
+std::string format_trees(const diff &diff) {
+	if (three_way) {
+		if (diff.conflict)
+			return " (conflict)";
+
+		// Differing directories are described by their children
+		if (has_sub_diffs(diff))
+			return "";
+
+		if (diff.trees.size() == 2)
+			return " (A, B)";
+
+		return diff.trees.front() == 1 ? " (A)" : " (B)";
+	}
+
+	if (roots.size() <= 2)
+		return "";
+
+	std::string str = " [";
+	for (size_t i = 0; i < diff.trees.size(); i++)
+		str += fmtns::format("{0}{1}", i ? ", " : "", diff.trees[i]);
+
+	return str + "]";
+}
+
+// Directories with more differences inside than this are displayed as a
+// summary instead (-1 meaning never)
+long long summary_threshold = -1;
+
+std::string format_size(std::uint64_t bytes) {
+	const std::array<const char *, 6> units{"B", "KiB", "MiB", "GiB", "TiB", "PiB"};
+
+	double size = bytes;
+	size_t unit = 0;
+	while (size >= 1024 && unit + 1 < units.size()) {
+		size /= 1024;
+		unit++;
+	}
+
+	if (!unit)
+		return fmtns::format("{0} B", bytes);
+
+	return fmtns::format("{0:.1f} {1}", size, units[unit]);
+}
+
+std::string format_criterion(const diff &diff) {
+	if (diff.same_as.size())
+		return fmtns::format(" (same as {0})", diff.same_as);
+
+	switch (diff.criterion) {
+		case diff_criterion::contents: return "";
+		case diff_criterion::size: return " (different sizes)";
+		case diff_criterion::mtime: return " (different modification times)";
+	}
+
+	return "";
+}
+
+std::string format_summary(const diff_summary &summary) {
+	std::string str;
+	auto add = [&] (std::uint64_t count, std::string_view what) {
+		if (count)
+			str += fmtns::format("{0}{1} {2}", str.empty() ? "" : ", ", count, what);
+	};
+
+	add(summary.added, "added");
+	add(summary.removed, "removed");
+	add(summary.type_changed, "with different types");
+	add(summary.contents_changed, "with different contents");
+	add(summary.errors, summary.errors == 1 ? "error" : "errors");
+	add(summary.unwalked, summary.unwalked == 1 ? "directory not walked yet" : "directories not walked yet");
+
+	if (summary.bytes)
+		str += fmtns::format("; {0}", format_size(summary.bytes));
+
+	return str;
+}
+
 void display_diff(const diff &diff, int depth = 0) {
 	for (int i = 0; i < depth; i++)
 		fmtns::print("|  ");
 
+	auto trees = format_trees(diff);
+
 	switch (diff.type) {
 		using enum diff_type;
 		case missing:
 			print_in_color(
 				diff.n ? ansi_red : ansi_green,
-				"{0} {1}\n",
-				diff.n ? "-" : "+", diff.name);
+				"{0} {1}{2}\n",
+				diff.n ? "-" : "+", diff.name, trees);
 			break;
 		case file_type:
-			print_in_color(ansi_blue, "! {0}\n", diff.name);
+			print_in_color(ansi_blue, "! {0}{1}\n", diff.name, trees);
+			break;
+		case error:
+			print_in_color(ansi_magenta, "E {0}{1} ({2})\n", diff.name, trees, diff.error);
 			break;
 		case contents:
-			if (!diff.sub_diffs.size()) {
-				print_in_color(ansi_yellow, "? {0}\n", diff.name);
+			if (!has_sub_diffs(diff)) {
+				print_in_color(ansi_yellow, "? {0}{1}{2}\n", diff.name, trees, format_criterion(diff));
 			} else if (should_prune_diff(diff, depth)) {
-				print_in_color(ansi_yellow, "? {0} (pruned; different)\n", diff.name);
+				print_in_color(ansi_yellow, "? {0}{1} (pruned; different)\n", diff.name, trees);
 			} else {
 				if (git_diff_depth >= 0 && (depth - 1) == git_diff_depth) {
-					generate_git_diff(diff.a_path, diff.b_path);
+					auto rel = diff.a_path.string().substr(roots[0].string().size());
+
+					for (auto tree : diff.trees)
+						generate_git_diff(diff.a_path, roots[tree] / rel);
+				}
+
+				// Loaded sub-diffs are only kept while they're displayed
+				std::vector<struct diff> loaded;
+				if (diff.lazy_sub_diffs) {
+					loaded = diff.lazy_sub_diffs();
+
+					if (diff.lazy_walk && !run_quietly && using_color)
+						fmtns::print(std::cerr, "{0}", ansi_clear_to_beginning_of_line);
 				}
 
-				print_in_color(ansi_yellow, "? {0}:\n", diff.name);
-				for (const auto &sub : diff.sub_diffs)
+				const auto &sub_diffs = diff.lazy_sub_diffs ? loaded : diff.sub_diffs;
+				auto summary = diff.lazy_walk ? summarize(sub_diffs) : diff.summary;
+
+				// The '<root>' node is always listed, so that there's more than one line
+				if (depth && summary_threshold >= 0
+						&& summary.entries() > static_cast<std::uint64_t>(summary_threshold)) {
+					print_in_color(ansi_yellow, "? {0}{1} ({2})\n", diff.name, trees, format_summary(summary));
+					break;
+				}
+
+				print_in_color(ansi_yellow, "? {0}{1}:\n", diff.name, trees);
+				for (const auto &sub : sub_diffs)
 					display_diff(sub, depth + 1);
 			}
 			break;
 	}
 }
 
+void display_largest() {
+	for (const auto &[bytes, path, diff] : largest_diffs()) {
+		auto size = fmtns::format("{0:>10}  ", format_size(bytes));
+		auto trees = format_trees(diff);
+
+		switch (diff.type) {
+			using enum diff_type;
+			case missing:
+				print_in_color(
+					diff.n ? ansi_red : ansi_green,
+					"{0}{1} {2}{3}\n",
+					size, diff.n ? "-" : "+", path, trees);
+				break;
+			case file_type:
+				print_in_color(ansi_blue, "{0}! {1}{2}\n", size, path, trees);
+				break;
+			case error:
+				print_in_color(ansi_magenta, "{0}E {1}{2} ({3})\n", size, path, trees, diff.error);
+				break;
+			case contents: {
+				// Directories are listed along with what differs in them
+				auto summary = diff.summary;
+				summary.bytes = 0;
+
+				if (summary.entries())
+					print_in_color(ansi_yellow, "{0}? {1}{2} ({3})\n", size, path, trees, format_summary(summary));
+				else
+					print_in_color(ansi_yellow, "{0}? {1}{2}{3}\n", size, path, trees, format_criterion(diff));
+				break;
+			}
+		}
+	}
+}
+
+void display_quick_legend() {
+	if (quick_compare == quick_check::none)
+		return;
+
+	fmtns::print("  {0}? foo (different sizes){1} - sizes differ (contents not compared)\n", ansi_yellow, ansi_reset);
+	if (quick_compare == quick_check::mtime)
+		fmtns::print("  {0}? foo (different modification times){1} - sizes are the same, but modification times\n"
+				"    differ (contents not compared)\n", ansi_yellow, ansi_reset);
+}
+
 int main(int argc, char **argv) {
 	const struct option options[] = {
 		{"help",	no_argument,		0, 'h'},
@@ -239,19 +699,78 @@ int main(int argc, char **argv) {
 		{"prune",	required_argument,	0, 'p'},
 		{"no-default-prune",	no_argument,	0, 'P'},
 		{"max-depth",	required_argument,	0, 'm'},
+		{"base",	required_argument,	0, 'b'},
+		{"keep-going",	no_argument,		0, 'k'},
+		{"one-file-system",	no_argument,	0, 'x'},
+		{"follow",	no_argument,		0, 'L'},
 		{"paranoid",	no_argument,		0, 300},
+		{"hash",	required_argument,	0, 301},
+		{"compare",	required_argument,	0, 302},
+		{"order",	required_argument,	0, 303},
+		{"prefetch",	no_argument,		0, 304},
+		{"io",		required_argument,	0, 305},
+		{"huge-pages",	no_argument,		0, 306},
+		{"checkpoint",	required_argument,	0, 307},
+		{"resume",	required_argument,	0, 308},
+		{"checkpoint-interval",	required_argument,	0, 309},
+		{"shard",	required_argument,	0, 310},
+		{"shard-depth",	required_argument,	0, 311},
+		{"save",	required_argument,	0, 312},
+		{"load",	required_argument,	0, 313},
+		{"interactive",	no_argument,		0, 314},
+		{"lazy-depth",	required_argument,	0, 315},
+		{"summary",	required_argument,	0, 316},
+		{"top",		required_argument,	0, 317},
+		{"quick",	required_argument,	0, 318},
+		{"block-map",	required_argument,	0, 319},
+		{"block-size",	required_argument,	0, 320},
+		{"timeout",	required_argument,	0, 321},
+		{"nice",	required_argument,	0, 322},
+		{"ioprio",	required_argument,	0, 323},
+		{"bwlimit",	required_argument,	0, 324},
+		{"show-mounts",	no_argument,		0, 325},
+		{"only",	required_argument,	0, 326},
+		{"files-from",	required_argument,	0, 327},
 		{0,		0,			0, 0}
 	};
 
 	bool print_legend = true;
 
+	bool interactive = false;
+
 	bool force_color = false, never_color = false;
 
 	bool add_default_prune_patterns = true;
 
+	const char *base = nullptr;
+
+	const char *checkpoint_file = nullptr;
+	bool resume = false;
+
+	const char *save_file = nullptr;
+	const char *load_file = nullptr;
+
+	const char *block_map = nullptr;
+	std::uint64_t block_size = 1024 * 1024;
+
+	bool show_mounts = false;
+
+	const char *files_from = nullptr;
+
+	int niceness = 0;
+	std::optional<io_priority> io_prio;
+
+	// Combine saved results instead of comparing trees with "dir-diff merge"
+	bool merging = argc > 1 && std::string_view{argv[1]} == "merge";
+	if (merging) {
+		argv[1] = argv[0];
+		argc--;
+		argv++;
+	}
+
 	while (true) {
 		int option_index = 0;
-		int c = getopt_long(argc, argv, "hvlqc:d:i:p:Pm:", options, &option_index);
+		int c = getopt_long(argc, argv, "hvlqc:d:i:p:Pm:b:kxL", options, &option_index);
 
 		if (c == -1)
 			break;
@@ -298,25 +817,299 @@ int main(int argc, char **argv) {
 				}
 				break;
 			}
+			case 'b': base = optarg; break;
+			case 'k': keep_going = true; break;
+			case 'x': one_file_system = true; break;
+			case 'L': follow_symlinks = true; break;
 			case 300: paranoid = true; break;
+			case 301: {
+				auto algo = parse_hash_algorithm(optarg);
+				if (!algo) {
+					fmtns::print(std::cerr, "Unknown --hash algorithm: {0}\n", optarg);
+					return 1;
+				}
+
+				if (!is_hash_algorithm_available(*algo)) {
+					fmtns::print(std::cerr, "Hash algorithm not supported by this build: {0}\n", optarg);
+					return 1;
+				}
+
+				hash_algo = *algo;
+				break;
+			}
+			case 302: {
+				std::string_view v{optarg};
+				if (v == "lockstep")
+					content_compare = compare_mode::lockstep;
+				else if (v == "hash")
+					content_compare = compare_mode::hash;
+				else {
+					fmtns::print(std::cerr, "Unknown --compare mode: {0}\n", v);
+					return 1;
+				}
+				break;
+			}
+			case 303: {
+				std::string_view v{optarg};
+				if (v == "none")
+					traversal_order = walk_order::none;
+				else if (v == "inode")
+					traversal_order = walk_order::inode;
+				else if (v == "physical")
+					traversal_order = walk_order::physical;
+				else {
+					fmtns::print(std::cerr, "Unknown --order: {0}\n", v);
+					return 1;
+				}
+				break;
+			}
+			case 304: prefetch = true; break;
+			case 305: {
+				auto backend = parse_io_backend(optarg);
+				if (!backend) {
+					fmtns::print(std::cerr, "Unknown --io backend: {0}\n", optarg);
+					return 1;
+				}
+
+				compare_io = *backend;
+				break;
+			}
+			case 306: use_huge_pages = true; break;
+			case 307: checkpoint_file = optarg; resume = false; break;
+			case 308: checkpoint_file = optarg; resume = true; break;
+			case 309: {
+				unsigned seconds;
+				auto out = std::from_chars(optarg, optarg + strlen(optarg), seconds);
+				if (out.ec != std::errc{}) {
+					fmtns::print(std::cerr, "Illegal value for --checkpoint-interval: {0}\n", optarg);
+					return 1;
+				}
+
+				checkpoint_interval = std::chrono::seconds{seconds};
+				break;
+			}
+			case 310: {
+				auto end = optarg + strlen(optarg);
+				unsigned k = 0, n = 0;
+
+				auto out = std::from_chars(optarg, end, k);
+				if (out.ec == std::errc{} && out.ptr != end && *out.ptr == '/')
+					out = std::from_chars(out.ptr + 1, end, n);
+
+				if (out.ec != std::errc{} || out.ptr != end || !k || k > n) {
+					fmtns::print(std::cerr, "Illegal value for --shard: {0}\n", optarg);
+					return 1;
+				}
+
+				shard_index = k - 1;
+				shard_count = n;
+				break;
+			}
+			case 311: {
+				auto out = std::from_chars(optarg, optarg + strlen(optarg), shard_depth);
+				if (out.ec != std::errc{} || shard_depth < 1) {
+					fmtns::print(std::cerr, "Illegal value for --shard-depth: {0}\n", optarg);
+					return 1;
+				}
+				break;
+			}
+			case 312: save_file = optarg; break;
+			case 313: load_file = optarg; break;
+			case 314: interactive = true; break;
+			case 315: {
+				auto out = std::from_chars(optarg, optarg + strlen(optarg), lazy_depth);
+				if (out.ec != std::errc{} || lazy_depth < 1) {
+					fmtns::print(std::cerr, "Illegal value for --lazy-depth: {0}\n", optarg);
+					return 1;
+				}
+				break;
+			}
+			case 316: {
+				auto out = std::from_chars(optarg, optarg + strlen(optarg), summary_threshold);
+				if (out.ec != std::errc{} || summary_threshold < 0) {
+					fmtns::print(std::cerr, "Illegal value for --summary: {0}\n", optarg);
+					return 1;
+				}
+
+				break;
+			}
+			case 317: {
+				auto out = std::from_chars(optarg, optarg + strlen(optarg), top_count);
+				if (out.ec != std::errc{} || !top_count) {
+					fmtns::print(std::cerr, "Illegal value for --top: {0}\n", optarg);
+					return 1;
+				}
+
+				break;
+			}
+			case 318: {
+				std::string_view v{optarg};
+				if (v == "size")
+					quick_compare = quick_check::size;
+				else if (v == "mtime")
+					quick_compare = quick_check::mtime;
+				else {
+					fmtns::print(std::cerr, "Unknown --quick criterion: {0}\n", v);
+					return 1;
+				}
+				break;
+			}
+			case 319: block_map = optarg; break;
+			case 320: {
+				auto size = parse_size(optarg);
+				if (!size || !*size) {
+					fmtns::print(std::cerr, "Illegal value for --block-size: {0}\n", optarg);
+					return 1;
+				}
+
+				block_size = *size;
+				break;
+			}
+			case 321: {
+				unsigned seconds;
+				auto out = std::from_chars(optarg, optarg + strlen(optarg), seconds);
+				if (out.ec != std::errc{} || !seconds) {
+					fmtns::print(std::cerr, "Illegal value for --timeout: {0}\n", optarg);
+					return 1;
+				}
+
+				operation_timeout = std::chrono::seconds{seconds};
+				keep_going = true;
+				break;
+			}
+			case 322: {
+				auto out = std::from_chars(optarg, optarg + strlen(optarg), niceness);
+				if (out.ec != std::errc{} || *out.ptr) {
+					fmtns::print(std::cerr, "Illegal value for --nice: {0}\n", optarg);
+					return 1;
+				}
+				break;
+			}
+			case 323: {
+				io_prio = parse_io_priority(optarg);
+				if (!io_prio) {
+					fmtns::print(std::cerr, "Illegal value for --ioprio: {0}\n", optarg);
+					return 1;
+				}
+				break;
+			}
+			case 324: {
+				auto rate = parse_size(optarg);
+				if (!rate || !*rate) {
+					fmtns::print(std::cerr, "Illegal value for --bwlimit: {0}\n", optarg);
+					return 1;
+				}
+
+				bandwidth_limit = *rate;
+				break;
+			}
+			case 325:
+				show_mounts = true;
+				one_file_system = true;
+				break;
+			case 326: only_patterns.push_back(optarg); break;
+			case 327: files_from = optarg; break;
 			case '?': return 1;
 		}
 	}
 
-	if (optind < argc && argc - optind >= 2) {
-		root1 = argv[optind++];
-		root1 /= "";
-		root2 = argv[optind++];
-		root2 /= "";
-	} else {
-		fmtns::print("Missing positional argument(s): <path> <path>\n");
+	if (interactive && (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))) {
+		fmtns::print(std::cerr, "--interactive requires a terminal\n");
+		return 1;
+	}
+
+	if (block_map) {
+		// Block maps are computed while comparing the files chunk by chunk
+		if (quick_compare != quick_check::none || content_compare == compare_mode::hash
+				|| compare_io == io_backend::stream) {
+			fmtns::print(std::cerr, "--block-map can't be combined with --quick, --compare=hash or --io=stream\n");
+			return 1;
+		}
+
+		block_map_dir = block_map;
+		block_map_size = block_size;
+	}
+
+	// Each of these accesses the files in ways that can't be given a deadline
+	if (operation_timeout != std::chrono::milliseconds::zero()
+			&& (prefetch || traversal_order == walk_order::physical || compare_io != io_backend::read)) {
+		fmtns::print(std::cerr, "--timeout can't be combined with --prefetch, --order=physical or --io=stream|mmap\n");
+		return 1;
+	}
+
+	// Only the largest differences are kept around, so there's no tree to
+	// save, browse, or walk further later
+	if (top_count && (save_file || interactive || lazy_depth >= 0)) {
+		fmtns::print(std::cerr, "--top can't be combined with --save, --interactive or --lazy-depth\n");
+		return 1;
+	}
+
+	// Directories only checked for whether they differ would count as walked
+	if (follow_symlinks && lazy_depth >= 0) {
+		fmtns::print(std::cerr, "--follow can't be combined with --lazy-depth\n");
+		return 1;
+	}
+
+	// The listed paths are compared at the same time, in their own order,
+	// rather than in a walk
+	if (files_from && (merging || load_file || checkpoint_file || shard_count > 1 || lazy_depth >= 0
+			|| prefetch || traversal_order != walk_order::none || only_patterns.size())) {
+		fmtns::print(std::cerr, "--files-from can't be combined with merge, --load, --checkpoint, --resume,"
+				" --shard, --lazy-depth, --prefetch, --order or --only\n");
+		return 1;
+	}
+
+	// The list is printed after the diff, which isn't with --interactive
+	if (show_mounts && interactive) {
+		fmtns::print(std::cerr, "--show-mounts can't be combined with --interactive\n");
+		return 1;
+	}
+
+	// Each of these reads or opens the files
+	if (quick_compare != quick_check::none
+			&& (paranoid || prefetch || traversal_order == walk_order::physical)) {
+		fmtns::print(std::cerr, "--quick can't be combined with --paranoid, --prefetch or --order=physical\n");
 		return 1;
 	}
 
+	if (merging) {
+		if (optind == argc) {
+			fmtns::print("Missing positional argument(s): <file>...\n");
+			return 1;
+		}
+	} else if (load_file) {
+		if (optind != argc) {
+			fmtns::print("No positional arguments are allowed with --load\n");
+			return 1;
+		}
+	} else {
+		if (base) {
+			if (argc - optind != 2) {
+				fmtns::print("Exactly two positional arguments are required with --base: <path> <path>\n");
+				return 1;
+			}
+
+			three_way = true;
+
+			auto &root = roots.emplace_back(base);
+			root /= "";
+		}
+
+		if (optind < argc && argc - optind >= 2) {
+			while (optind < argc) {
+				auto &root = roots.emplace_back(argv[optind++]);
+				root /= "";
+			}
+		} else {
+			fmtns::print("Missing positional argument(s): <path> <path> [<path>...]\n");
+			return 1;
+		}
+	}
+
 	if ((!isatty(STDOUT_FILENO) && !force_color) || never_color) {
 		using_color = false;
 
-		ansi_reset = ansi_red = ansi_green = ansi_yellow = ansi_blue = "";
+		ansi_reset = ansi_red = ansi_green = ansi_yellow = ansi_blue = ansi_magenta = "";
 	}
 
 	if (add_default_prune_patterns) {
@@ -324,25 +1117,193 @@ int main(int argc, char **argv) {
 			prune_patterns.push_back(pat);
 	}
 
-	auto diffs = diff_trees(fs::directory_entry{root1}, fs::directory_entry{root2});
+	// Both only apply to the calling thread, and are inherited by the
+	// threads it starts later on
+	if (niceness) {
+		errno = 0;
+		if (nice(niceness) == -1 && errno) {
+			fmtns::print(std::cerr, "Failed to change the niceness: {0}\n", strerror(errno));
+			return 1;
+		}
+	}
+
+	if (io_prio && !set_io_priority(*io_prio)) {
+		fmtns::print(std::cerr, "Failed to set the I/O priority: {0}\n", strerror(errno));
+		return 1;
+	}
+
+	std::vector<std::string> listed_paths;
+	if (files_from) {
+		try {
+			listed_paths = read_path_list(files_from);
+		} catch (const std::exception &err) {
+			fmtns::print(std::cerr, "Failed to read the list of paths {0}\n", err.what());
+			return 1;
+		}
+	}
+
+	std::vector<diff> diffs;
+
+	// Loaded differences are offered all at once, once they're loaded, and
+	// so are the differences in listed paths, which are compared at once
+	if (merging || load_file || files_from)
+		offer_walked = false;
+
+	if (merging) {
+		try {
+			diffs = merge_results({argv + optind, argv + argc});
+		} catch (const std::exception &err) {
+			fmtns::print(std::cerr, "Failed to merge results: {0}\n", err.what());
+			return 1;
+		}
+	} else if (load_file) {
+		try {
+			diffs = load_results(load_file);
+		} catch (const std::exception &err) {
+			fmtns::print(std::cerr, "Failed to load results {0}\n", err.what());
+			return 1;
+		}
+	}
+
+	if (merging || load_file) {
+		record_largest("", diffs, true);
+	} else {
+		// Before the roots are looked up, which may start threads
+		if (checkpoint_file) {
+			try {
+				open_checkpoint(checkpoint_file, resume, ignore_patterns, only_patterns);
+			} catch (const std::exception &err) {
+				fmtns::print(std::cerr, "Failed to open checkpoint {0}\n", err.what());
+				return 1;
+			}
+		}
+
+		tree_entry a_root{0, dir_entry{roots[0]}};
+
+		// Roots which are the same directory as the reference one (like
+		// through a symlink or a bind mount) can't differ from it
+		std::vector<tree_entry> b_roots;
+		for (size_t i = 1; i < roots.size(); i++) {
+			tree_entry b_root{static_cast<int>(i), dir_entry{roots[i]}};
+			if (paranoid || !is_same_directory(a_root, b_root))
+				b_roots.push_back(std::move(b_root));
+		}
+
+		try {
+			if (b_roots.size() && files_from)
+				diffs = diff_paths(b_roots, listed_paths);
+			else if (b_roots.size())
+				diffs = diff_trees(a_root, b_roots);
+		} catch (const walk_error &err) {
+			close_checkpoint();
+
+			if (!run_quietly && using_color)
+				fmtns::print(std::cerr, "{0}", ansi_clear_to_beginning_of_line);
+
+			fmtns::print(std::cerr, "Failed to read {0}\n", err.message());
+			return 2;
+		}
+
+		close_checkpoint();
+
+		if (files_from)
+			record_largest("", diffs, true);
+	}
+
+	if (save_file) {
+		try {
+			save_results(save_file, diffs);
+		} catch (const std::exception &err) {
+			fmtns::print(std::cerr, "Failed to save results {0}\n", err.what());
+			return 1;
+		}
+	}
+
 	if (!run_quietly && using_color)
 		fmtns::print(std::cerr, "{0}", ansi_clear_to_beginning_of_line);
 
 	if (!diffs.size()) {
 		fmtns::print("No differences.\n");
 	} else {
-		diff root{diff_type::contents, -1, "<root>", root1, root2, std::move(diffs)};
+		diff root{diff_type::contents, -1, "<root>", roots[0], roots[1], std::move(diffs)};
+
+		for (const auto &sub : root.sub_diffs)
+			root.trees.insert(root.trees.end(), sub.trees.begin(), sub.trees.end());
+
+		std::ranges::sort(root.trees);
+		root.trees.erase(std::unique(root.trees.begin(), root.trees.end()), root.trees.end());
+
+		root.summary = summarize(root.sub_diffs);
+
+		if (interactive) {
+			// Directories walked while browsing would garble the screen
+			run_quietly = true;
+
+			browse_diffs(root);
+			return error_count ? 2 : 0;
+		}
 
 		if (print_legend) {
 			fmtns::print("Legend:\n");
-			fmtns::print("  {0}- foo{1} - exists only in 1st tree\n", ansi_red, ansi_reset);
-			fmtns::print("  {0}+ foo{1} - exists only in 2nd tree\n", ansi_green, ansi_reset);
-			fmtns::print("  {0}! foo{1} - types differ (directory vs file, etc)\n", ansi_blue, ansi_reset);
-			fmtns::print("  {0}? foo{1} - contents differ\n", ansi_yellow, ansi_reset);
+			if (three_way) {
+				fmtns::print("  {0}- foo{1} - exists only in the base\n", ansi_red, ansi_reset);
+				fmtns::print("  {0}+ foo{1} - doesn't exist in the base\n", ansi_green, ansi_reset);
+				fmtns::print("  {0}! foo{1} - types differ from the base (directory vs file, etc)\n", ansi_blue, ansi_reset);
+				fmtns::print("  {0}? foo{1} - contents differ from the base\n", ansi_yellow, ansi_reset);
+				fmtns::print("  {0}E foo{1} - couldn't be compared (see reason)\n", ansi_magenta, ansi_reset);
+				display_quick_legend();
+				fmtns::print("  foo (A) - changed only in A\n");
+				fmtns::print("  foo (B) - changed only in B\n");
+				fmtns::print("  foo (A, B) - changed the same way in both A and B\n");
+				fmtns::print("  foo (conflict) - changed differently in A and B\n");
+
+				fmtns::print("Trees:\n");
+				fmtns::print("  base: {0}\n", roots[0].string());
+				fmtns::print("  A: {0}\n", roots[1].string());
+				fmtns::print("  B: {0}\n", roots[2].string());
+			} else if (roots.size() <= 2) {
+				fmtns::print("  {0}- foo{1} - exists only in 1st tree\n", ansi_red, ansi_reset);
+				fmtns::print("  {0}+ foo{1} - exists only in 2nd tree\n", ansi_green, ansi_reset);
+				fmtns::print("  {0}! foo{1} - types differ (directory vs file, etc)\n", ansi_blue, ansi_reset);
+				fmtns::print("  {0}? foo{1} - contents differ\n", ansi_yellow, ansi_reset);
+				fmtns::print("  {0}E foo{1} - couldn't be compared (see reason)\n", ansi_magenta, ansi_reset);
+				display_quick_legend();
+			} else {
+				fmtns::print("  {0}- foo [1, 2]{1} - exists only in the reference tree, not in trees 1 and 2\n", ansi_red, ansi_reset);
+				fmtns::print("  {0}+ foo [1, 2]{1} - exists only in trees 1 and 2, not in the reference tree\n", ansi_green, ansi_reset);
+				fmtns::print("  {0}! foo [1, 2]{1} - types in trees 1 and 2 differ from the reference tree\n", ansi_blue, ansi_reset);
+				fmtns::print("  {0}? foo [1, 2]{1} - contents in trees 1 and 2 differ from the reference tree\n", ansi_yellow, ansi_reset);
+				fmtns::print("  {0}E foo [1]{1} - couldn't be compared against tree 1 (see reason)\n", ansi_magenta, ansi_reset);
+				display_quick_legend();
+
+				fmtns::print("Trees:\n");
+				fmtns::print("  0: {0} (reference)\n", roots[0].string());
+				for (size_t i = 1; i < roots.size(); i++)
+					fmtns::print("  {0}: {1}\n", i, roots[i].string());
+			}
 		}
 
-		fmtns::print("Diff:\n");
+		if (top_count) {
+			fmtns::print("Largest differences:\n");
+			display_largest();
+		} else {
+			fmtns::print("Diff:\n");
+			display_diff(root);
+		}
+	}
 
-		display_diff(root);
+	if (show_mounts && skipped_mounts.size()) {
+		// Directories walked twice (like when checking whether they
+		// differ first) run into the same mount points again
+		std::ranges::sort(skipped_mounts);
+		auto dups = std::ranges::unique(skipped_mounts);
+		skipped_mounts.erase(dups.begin(), dups.end());
+
+		fmtns::print("Mount points not walked:\n");
+		for (const auto &path : skipped_mounts)
+			fmtns::print("  {0}\n", path.string());
 	}
+
+	// Like diff(1), signal trouble with an exit status of 2
+	return error_count ? 2 : 0;
 }
@@ -0,0 +1,436 @@
+/* Directory diff utility - Saving and merging of results
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <results.hpp>
+#include <serialize.hpp>
+#include <retry.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace {
+
+// The file starts with the magic, followed by the format version, whether
+// it's a three-way diff, the roots, and the shard. The differences come after
+// that, with the differences in each directory stored together in a block,
+// and the blocks of subdirectories coming before the blocks of their parents.
+// The file ends with a trailer holding the offset of the block for the roots
+// and the number of errors in all blocks, so that any directory can be loaded
+// without reading the rest of the file.
+constexpr std::string_view results_magic = "dir-diff results\n";
+constexpr std::uint64_t results_version = 2;
+constexpr size_t trailer_size = 16;
+
+// Stored in place of the offset of the block for directories which haven't
+// been walked yet (which can't be a valid offset, being inside the header)
+constexpr std::uint64_t unwalked_block = 1;
+
+struct results_header {
+	bool three_way;
+	std::vector<fs::path> roots;
+	unsigned shard_index, shard_count;
+	int shard_depth;
+
+	bool same_comparison(const results_header &other) const {
+		return three_way == other.three_way && roots == other.roots
+			&& shard_count == other.shard_count && shard_depth == other.shard_depth;
+	}
+};
+
+struct results_trailer {
+	std::uint64_t root_block;
+	std::uint64_t error_count;
+};
+
+// Buffers the contents of the file, writing them out in large chunks
+class results_writer {
+public:
+	results_writer(const fs::path &path)
+	: path_{path} {
+		fd_ = retry_syscall([&] { return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666); });
+		if (fd_ < 0)
+			throw error("open failed");
+	}
+
+	~results_writer() {
+		close(fd_);
+	}
+
+	results_writer(const results_writer &) = delete;
+	results_writer &operator=(const results_writer &) = delete;
+
+	std::string &buffer() {
+		return buffer_;
+	}
+
+	std::uint64_t offset() const {
+		return written_ + buffer_.size();
+	}
+
+	void flush(bool force = false) {
+		if (!force && buffer_.size() < flush_size)
+			return;
+
+		std::string_view data = buffer_;
+		while (!data.empty()) {
+			auto ret = retry_syscall([&] { return write(fd_, data.data(), data.size()); });
+			if (ret < 0)
+				throw error("write failed");
+
+			data.remove_prefix(ret);
+		}
+
+		written_ += buffer_.size();
+		buffer_.clear();
+	}
+
+private:
+	static constexpr size_t flush_size = 1024 * 1024;
+
+	std::system_error error(const char *what) {
+		return {errno, std::system_category(), path_.string() + ": " + what};
+	}
+
+	fs::path path_;
+	int fd_;
+	std::string buffer_;
+	std::uint64_t written_ = 0;
+};
+
+// A results file mapped into memory, shared by the differences loaded from it
+class results_mapping {
+public:
+	results_mapping(const fs::path &path) {
+		int fd = retry_syscall([&] { return open(path.c_str(), O_RDONLY | O_CLOEXEC); });
+		if (fd < 0)
+			throw std::system_error{errno, std::system_category(), path.string() + ": open failed"};
+
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			int err = errno;
+			close(fd);
+			throw std::system_error{err, std::system_category(), path.string() + ": stat failed"};
+		}
+
+		size_ = st.st_size;
+		if (size_) {
+			data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data_ == MAP_FAILED) {
+				int err = errno;
+				close(fd);
+				throw std::system_error{err, std::system_category(), path.string() + ": mmap failed"};
+			}
+		}
+
+		close(fd);
+	}
+
+	~results_mapping() {
+		if (data_ != MAP_FAILED)
+			munmap(data_, size_);
+	}
+
+	results_mapping(const results_mapping &) = delete;
+	results_mapping &operator=(const results_mapping &) = delete;
+
+	std::string_view contents() const {
+		if (data_ == MAP_FAILED)
+			return {};
+
+		return {static_cast<const char *>(data_), size_};
+	}
+
+private:
+	void *data_ = MAP_FAILED;
+	size_t size_ = 0;
+};
+
+// Writes the blocks of the subdirectories followed by the block for the
+// differences, returns its offset, and counts the errors in them
+std::uint64_t write_block(results_writer &out, const std::vector<diff> &diffs, std::uint64_t &errors) {
+	// Entries without inner differences have no block, which is marked by 0
+	std::vector<std::uint64_t> sub_blocks;
+
+	for (const auto &diff : diffs) {
+		errors += diff.type == diff_type::error;
+
+		if (diff.lazy_walk)
+			sub_blocks.push_back(unwalked_block);
+		else if (diff.lazy_sub_diffs)
+			sub_blocks.push_back(write_block(out, diff.lazy_sub_diffs(), errors));
+		else if (diff.sub_diffs.size())
+			sub_blocks.push_back(write_block(out, diff.sub_diffs, errors));
+		else
+			sub_blocks.push_back(0);
+	}
+
+	auto offset = out.offset();
+
+	write_u64(out.buffer(), diffs.size());
+	for (size_t i = 0; i < diffs.size(); i++) {
+		write_diff(out.buffer(), diffs[i]);
+		write_u64(out.buffer(), sub_blocks[i]);
+	}
+
+	out.flush();
+	return offset;
+}
+
+void write_fixed_u64(std::string &out, std::uint64_t value) {
+	for (int i = 0; i < 8; i++)
+		out.push_back(static_cast<char>(value >> (i * 8)));
+}
+
+std::uint64_t read_fixed_u64(std::string_view in) {
+	std::uint64_t value = 0;
+	for (int i = 0; i < 8; i++)
+		value |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(in[i])) << (i * 8);
+
+	return value;
+}
+
+std::vector<diff> read_block(const std::shared_ptr<results_mapping> &mapping, std::uint64_t offset,
+		const std::shared_ptr<const std::vector<fs::path>> &roots);
+
+// The differences in a block that can't be read are replaced by an error, so that
+// the rest of the results can still be browsed
+std::vector<diff> read_block_or_error(const std::shared_ptr<results_mapping> &mapping, std::uint64_t offset,
+		const std::shared_ptr<const std::vector<fs::path>> &roots, const std::vector<int> &trees) {
+	try {
+		return read_block(mapping, offset, roots);
+	} catch (const corrupt_file &err) {
+		error_count++;
+		return {{diff_type::error, -1, "<results>", "", "", {}, trees, false,
+			std::string{"corrupt results file: "} + err.what()}};
+	}
+}
+
+// Reads a block of the comparison of the given roots
+std::vector<diff> read_block(const std::shared_ptr<results_mapping> &mapping, std::uint64_t offset,
+		const std::shared_ptr<const std::vector<fs::path>> &roots) {
+	auto in = mapping->contents();
+	if (offset >= in.size())
+		throw corrupt_file{"block out of bounds"};
+
+	in.remove_prefix(offset);
+
+	std::vector<diff> diffs;
+
+	auto n_diffs = read_u64(in);
+	for (std::uint64_t i = 0; i < n_diffs; i++) {
+		auto &diff = diffs.emplace_back(read_diff(in, *roots, 0));
+
+		// Blocks only ever refer to the ones before them, so they can't form loops
+		auto sub_block = read_u64(in);
+		if (sub_block >= offset)
+			throw corrupt_file{"block out of order"};
+
+		if (sub_block == unwalked_block) {
+			diff.lazy_sub_diffs = [a_path = diff.a_path] { return diff_directory(a_path); };
+			diff.lazy_walk = true;
+		} else if (sub_block) {
+			diff.lazy_sub_diffs = [mapping, sub_block, roots, trees = diff.trees] {
+				return read_block_or_error(mapping, sub_block, roots, trees);
+			};
+		}
+
+		// Directories are displayed (and walked) by their path
+		if (diff.type == diff_type::contents && has_sub_diffs(diff) && diff.a_path.empty())
+			throw corrupt_file{"directory without a path"};
+	}
+
+	return diffs;
+}
+
+results_header read_header(std::string_view &in) {
+	if (!in.starts_with(results_magic))
+		throw corrupt_file{"not a dir-diff results file"};
+
+	in.remove_prefix(results_magic.size());
+
+	if (read_u64(in) != results_version)
+		throw corrupt_file{"unsupported results file version"};
+
+	results_header header;
+	header.three_way = read_u64(in);
+
+	auto n_roots = read_u64(in);
+	for (std::uint64_t i = 0; i < n_roots; i++)
+		header.roots.emplace_back(read_string(in));
+
+	if (header.roots.size() < 2)
+		throw corrupt_file{"malformed list of roots"};
+
+	header.shard_index = read_u64(in);
+	header.shard_count = read_u64(in);
+	header.shard_depth = read_u64(in);
+
+	if (!header.shard_count || header.shard_index >= header.shard_count)
+		throw corrupt_file{"malformed shard"};
+
+	return header;
+}
+
+// Maps the file and loads the differences in the roots
+std::vector<diff> read_results(const fs::path &path, results_header &header) {
+	auto mapping = std::make_shared<results_mapping>(path);
+
+	try {
+		auto in = mapping->contents();
+		header = read_header(in);
+
+		if (in.size() < trailer_size)
+			throw corrupt_file{"unexpected end of file"};
+
+		auto trailer_data = mapping->contents().substr(mapping->contents().size() - trailer_size);
+		results_trailer trailer{read_fixed_u64(trailer_data), read_fixed_u64(trailer_data.substr(8))};
+
+		error_count += trailer.error_count;
+		auto roots = std::make_shared<const std::vector<fs::path>>(header.roots);
+		return read_block(mapping, trailer.root_block, roots);
+	} catch (const corrupt_file &err) {
+		throw corrupt_file{path.string() + ": " + err.what()};
+	}
+}
+
+// Checks whether two differences describe the same change of the same entry,
+// possibly with the inner differences of directories split between them
+bool is_same_change(const diff &a, const diff &b) {
+	if (a.type != b.type || a.n != b.n || a.error != b.error || a.criterion != b.criterion
+			|| a.same_as != b.same_as)
+		return false;
+
+	if (has_sub_diffs(a) && has_sub_diffs(b))
+		return true;
+
+	return a.trees == b.trees;
+}
+
+void merge_diffs(std::vector<diff> &into, std::vector<diff> &&from) {
+	for (auto &diff : from) {
+		// Directories walked by every shard produce the same changes in
+		// every shard, apart from their inner differences
+		auto [first, last] = std::ranges::equal_range(into, diff.name, {}, &diff::name);
+		auto it = std::find_if(first, last, [&] (const auto &other) { return is_same_change(other, diff); });
+
+		if (it == last) {
+			// The differences of an entry are always in the same order,
+			// with the inner differences of directories last. Directories
+			// found in only one of the results are left to be loaded later.
+			into.insert(last, std::move(diff));
+			continue;
+		}
+
+		it->conflict |= diff.conflict;
+
+		if (has_sub_diffs(diff)) {
+			expand_sub_diffs(*it);
+			expand_sub_diffs(diff);
+			merge_diffs(it->sub_diffs, std::move(diff.sub_diffs));
+
+			it->trees.insert(it->trees.end(), diff.trees.begin(), diff.trees.end());
+			std::ranges::sort(it->trees);
+			it->trees.erase(std::unique(it->trees.begin(), it->trees.end()), it->trees.end());
+
+			auto rel = it->a_path.string().substr(roots[0].string().size());
+			it->b_path = roots[it->trees.front()] / rel;
+
+			it->summary = summarize(it->sub_diffs);
+		}
+	}
+}
+
+} // namespace anonymous
+
+void save_results(const fs::path &path, const std::vector<diff> &diffs) {
+	results_writer out{path};
+
+	auto &header = out.buffer();
+	header.append(results_magic);
+	write_u64(header, results_version);
+	write_u64(header, three_way);
+
+	write_u64(header, roots.size());
+	for (const auto &root : roots)
+		write_string(header, root.native());
+
+	write_u64(header, shard_index);
+	write_u64(header, shard_count);
+	write_u64(header, shard_depth);
+
+	std::uint64_t errors = 0;
+	auto root_block = write_block(out, diffs, errors);
+
+	write_fixed_u64(out.buffer(), root_block);
+	write_fixed_u64(out.buffer(), errors);
+	out.flush(true);
+}
+
+std::vector<diff> load_results(const fs::path &path) {
+	results_header header;
+	auto diffs = read_results(path, header);
+
+	roots = header.roots;
+	three_way = header.three_way;
+
+	return diffs;
+}
+
+std::vector<diff> merge_results(const std::vector<fs::path> &paths) {
+	std::vector<diff> diffs;
+	std::optional<results_header> first;
+	std::vector<bool> seen_shards;
+
+	for (const auto &path : paths) {
+		results_header header;
+		auto file_diffs = read_results(path, header);
+
+		if (!first) {
+			first = header;
+			seen_shards.resize(header.shard_count);
+
+			roots = header.roots;
+			three_way = header.three_way;
+		} else if (!first->same_comparison(header)) {
+			throw std::runtime_error{path.string() + ": results of a different comparison"};
+		}
+
+		if (seen_shards[header.shard_index])
+			throw std::runtime_error{path.string() + ": results for shard "
+				+ std::to_string(header.shard_index + 1) + " given more than once"};
+
+		seen_shards[header.shard_index] = true;
+
+		merge_diffs(diffs, std::move(file_diffs));
+	}
+
+	for (size_t i = 0; i < seen_shards.size(); i++) {
+		if (!seen_shards[i])
+			throw std::runtime_error{"missing results for shard " + std::to_string(i + 1)
+				+ "/" + std::to_string(seen_shards.size())};
+	}
+
+	return diffs;
+}
@@ -0,0 +1,36 @@
+/* Directory diff utility - Saving and merging of results
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <tree.hpp>
+#include <vector>
+
+// Writes the differences, along with the roots and the shard they were
+// computed by. Throws std::system_error on failure.
+void save_results(const fs::path &path, const std::vector<diff> &diffs);
+
+// Loads saved results, setting up the roots they were computed for. The
+// file is mapped into memory, and the inner differences of directories are
+// only loaded from it once they're needed. Throws std::system_error or
+// corrupt_file if the file can't be read.
+std::vector<diff> load_results(const fs::path &path);
+
+// Loads results saved by every shard of a comparison and combines them into
+// the results of a single unsharded run, like load_results. Throws
+// std::system_error, corrupt_file or std::runtime_error if the files can't
+// be read or don't fit together.
+std::vector<diff> merge_results(const std::vector<fs::path> &paths);
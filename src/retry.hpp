@@ -0,0 +1,64 @@
+/* Directory diff utility - Retrying of interrupted syscalls
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <type_traits>
+
+// Number of times a syscall failing with EAGAIN is retried before giving up
+inline constexpr int max_retries = 6;
+inline constexpr auto initial_backoff = std::chrono::milliseconds{10};
+
+inline bool is_transient_error(int err) {
+	return err == EINTR || err == EAGAIN || err == EWOULDBLOCK;
+}
+
+// Calls fn until it either succeeds, or fails with an error that's not
+// transient. Interrupted calls are retried right away, while ones failing
+// with EAGAIN (which network filesystems like to return) are retried with an
+// exponential backoff. Returns whatever fn returned last, with errno set.
+template <typename Fn>
+auto retry_syscall(Fn fn) {
+	auto backoff = initial_backoff;
+	int retries = 0;
+
+	while (true) {
+		auto ret = fn();
+
+		bool failed;
+		if constexpr (std::is_pointer_v<decltype(ret)>)
+			failed = !ret;
+		else
+			failed = ret < 0;
+
+		if (!failed || !is_transient_error(errno))
+			return ret;
+
+		if (errno == EINTR)
+			continue;
+
+		if (retries++ == max_retries)
+			return ret;
+
+		int err = errno;
+		std::this_thread::sleep_for(backoff);
+		backoff *= 2;
+		errno = err;
+	}
+}
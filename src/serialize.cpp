@@ -0,0 +1,134 @@
+/* Directory diff utility - Binary serialization helpers
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <serialize.hpp>
+
+void write_u64(std::string &out, std::uint64_t value) {
+	do {
+		std::uint8_t byte = value & 0x7F;
+		value >>= 7;
+		out.push_back(static_cast<char>(byte | (value ? 0x80 : 0)));
+	} while (value);
+}
+
+void write_string(std::string &out, std::string_view str) {
+	write_u64(out, str.size());
+	out.append(str);
+}
+
+std::uint64_t read_u64(std::string_view &in) {
+	std::uint64_t value = 0;
+
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (in.empty())
+			throw corrupt_file{"unexpected end of file"};
+
+		auto byte = static_cast<std::uint8_t>(in.front());
+		in.remove_prefix(1);
+
+		value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return value;
+	}
+
+	throw corrupt_file{"malformed integer"};
+}
+
+std::string_view read_string(std::string_view &in) {
+	auto size = read_u64(in);
+	if (size > in.size())
+		throw corrupt_file{"unexpected end of file"};
+
+	auto str = in.substr(0, size);
+	in.remove_prefix(size);
+	return str;
+}
+
+void write_diff(std::string &out, const diff &diff) {
+	write_u64(out, static_cast<std::uint64_t>(diff.type));
+	// n is -1 for everything except missing entries
+	write_u64(out, diff.n + 1);
+	write_string(out, diff.name);
+	write_string(out, diff.a_path.native());
+	write_string(out, diff.b_path.native());
+
+	write_u64(out, diff.trees.size());
+	for (auto tree : diff.trees)
+		write_u64(out, tree);
+
+	write_u64(out, diff.conflict);
+	write_string(out, diff.error);
+
+	write_u64(out, diff.size);
+	write_u64(out, static_cast<std::uint64_t>(diff.criterion));
+	write_string(out, diff.same_as);
+
+	const auto &summary = diff.summary;
+	for (auto count : {summary.added, summary.removed, summary.type_changed,
+			summary.contents_changed, summary.errors, summary.bytes, summary.unwalked})
+		write_u64(out, count);
+}
+
+diff read_diff(std::string_view &in, const std::vector<fs::path> &roots, int tree) {
+	auto type = read_u64(in);
+	if (type > static_cast<std::uint64_t>(diff_type::error))
+		throw corrupt_file{"unknown diff type"};
+
+	// Missing entries are missing in the reference tree (0) or in the
+	// other ones (1), everything else has no n
+	auto n = read_u64(in);
+	if (static_cast<diff_type>(type) == diff_type::missing ? n != 1 && n != 2 : n != 0)
+		throw corrupt_file{"malformed diff"};
+
+	diff diff{static_cast<diff_type>(type), static_cast<int>(n) - 1, std::string{read_string(in)}};
+
+	diff.a_path = read_string(in);
+	diff.b_path = read_string(in);
+
+	// Paths relative to the roots are taken from a_path
+	if (!diff.a_path.empty() && !diff.a_path.native().starts_with(roots[tree].native()))
+		throw corrupt_file{"path outside of the walked tree"};
+
+	auto n_diff_trees = read_u64(in);
+	if (!n_diff_trees || n_diff_trees > roots.size())
+		throw corrupt_file{"malformed list of trees"};
+
+	for (std::uint64_t i = 0; i < n_diff_trees; i++) {
+		auto diff_tree = read_u64(in);
+		if (diff_tree >= roots.size())
+			throw corrupt_file{"tree index out of range"};
+
+		diff.trees.push_back(diff_tree);
+	}
+
+	diff.conflict = read_u64(in);
+	diff.error = read_string(in);
+
+	diff.size = read_u64(in);
+
+	auto criterion = read_u64(in);
+	if (criterion > static_cast<std::uint64_t>(diff_criterion::mtime))
+		throw corrupt_file{"unknown diff criterion"};
+	diff.criterion = static_cast<diff_criterion>(criterion);
+	diff.same_as = read_string(in);
+
+	auto &summary = diff.summary;
+	for (auto count : {&summary.added, &summary.removed, &summary.type_changed,
+			&summary.contents_changed, &summary.errors, &summary.bytes, &summary.unwalked})
+		*count = read_u64(in);
+
+	return diff;
+}
@@ -0,0 +1,44 @@
+/* Directory diff utility - Binary serialization helpers
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <tree.hpp>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Thrown when reading a file that is truncated or otherwise malformed
+struct corrupt_file : std::runtime_error {
+	using std::runtime_error::runtime_error;
+};
+
+// Integers are stored as LEB128 varints, strings are prefixed by their length
+void write_u64(std::string &out, std::uint64_t value);
+void write_string(std::string &out, std::string_view str);
+
+std::uint64_t read_u64(std::string_view &in);
+std::string_view read_string(std::string_view &in);
+
+// Writes all of the fields of a diff, except for the sub-diffs and the lazy loading hook
+void write_diff(std::string &out, const diff &diff);
+
+// Reads a diff of a comparison of the given roots, checking that it only
+// refers to those trees, and to paths inside the tree that was walked (the
+// reference one, unless comparing other trees against each other)
+diff read_diff(std::string_view &in, const std::vector<fs::path> &roots, int tree);
@@ -0,0 +1,127 @@
+/* Directory diff utility - Resource usage limits
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <throttle.hpp>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <mutex>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+// A token bucket, holding up to a tenth of a second worth of reads so that
+// the limit holds over short periods too. The tokens can go negative, so that
+// reads larger than the bucket only have to wait for as long as they took up.
+class token_bucket {
+public:
+	std::chrono::steady_clock::duration take(size_t bytes) {
+		using namespace std::chrono;
+
+		std::lock_guard lock{mutex_};
+
+		auto now = steady_clock::now();
+		auto rate = static_cast<double>(bandwidth_limit);
+
+		if (!started_) {
+			tokens_ = rate / 10;
+			started_ = true;
+		} else {
+			duration<double> elapsed = now - last_;
+			tokens_ = std::min(rate / 10, tokens_ + elapsed.count() * rate);
+		}
+
+		last_ = now;
+		tokens_ -= bytes;
+
+		if (tokens_ >= 0)
+			return {};
+
+		return duration_cast<steady_clock::duration>(duration<double>{-tokens_ / rate});
+	}
+
+private:
+	std::mutex mutex_;
+	bool started_ = false;
+	std::chrono::steady_clock::time_point last_;
+	double tokens_ = 0;
+};
+
+token_bucket bucket;
+
+// From linux/ioprio.h, which isn't available everywhere
+constexpr int ioprio_class_shift = 13;
+constexpr int ioprio_class_be = 2;
+constexpr int ioprio_class_idle = 3;
+constexpr int ioprio_who_process = 1;
+
+} // namespace anonymous
+
+void throttle_read(size_t bytes) {
+	if (!bandwidth_limit || !bytes)
+		return;
+
+	// Sleep outside of the lock, so that other threads can take their share
+	// of the tokens in the meantime
+	auto wait = bucket.take(bytes);
+	if (wait > std::chrono::steady_clock::duration::zero())
+		std::this_thread::sleep_for(wait);
+}
+
+std::optional<io_priority> parse_io_priority(std::string_view str) {
+	auto colon = str.find(':');
+	auto name = str.substr(0, colon);
+
+	io_priority prio;
+	if (name == "idle") {
+		// The idle class has no levels
+		if (colon != std::string_view::npos)
+			return std::nullopt;
+
+		return io_priority{io_priority_class::idle, 0};
+	} else if (name == "best-effort") {
+		prio = {io_priority_class::best_effort, 4};
+	} else {
+		return std::nullopt;
+	}
+
+	if (colon == std::string_view::npos)
+		return prio;
+
+	auto level = str.substr(colon + 1);
+	auto out = std::from_chars(level.data(), level.data() + level.size(), prio.level);
+	if (out.ec != std::errc{} || out.ptr != level.data() + level.size()
+			|| prio.level < 0 || prio.level > 7)
+		return std::nullopt;
+
+	return prio;
+}
+
+bool set_io_priority(io_priority prio) {
+	int value = 0;
+	switch (prio.cls) {
+		case io_priority_class::idle:
+			value = ioprio_class_idle << ioprio_class_shift;
+			break;
+		case io_priority_class::best_effort:
+			value = (ioprio_class_be << ioprio_class_shift) | prio.level;
+			break;
+	}
+
+	return syscall(SYS_ioprio_set, ioprio_who_process, 0, value) == 0;
+}
@@ -0,0 +1,50 @@
+/* Directory diff utility - Resource usage limits
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+// Largest rate at which file contents are read, in bytes per second (0 meaning
+// no limit), shared by everything that reads them
+inline std::uint64_t bandwidth_limit = 0;
+
+// Accounts for the given amount of file contents having been read, sleeping
+// for as long as needed to stay under the bandwidth limit
+void throttle_read(size_t bytes);
+
+enum class io_priority_class {
+	// Only gets to use the disk when no one else does
+	idle,
+	// Shares the disk with everything else, at one of 8 levels (0 being
+	// the highest priority)
+	best_effort
+};
+
+struct io_priority {
+	io_priority_class cls;
+	int level;
+};
+
+// Parses CLASS[:LEVEL], CLASS being 'idle' or 'best-effort'
+std::optional<io_priority> parse_io_priority(std::string_view str);
+
+// Sets the I/O priority of the calling thread, which threads started by it
+// afterwards inherit. Returns false with errno set on failure.
+bool set_io_priority(io_priority prio);
@@ -0,0 +1,99 @@
+/* Directory diff utility - Largest differences
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <top.hpp>
+#include <algorithm>
+#include <mutex>
+#include <queue>
+#include <utility>
+
+namespace {
+
+// Orders entries from the largest to the smallest, with ties broken by the
+// path so that the same entries are kept regardless of the walk order
+bool is_larger(const top_entry &a, const top_entry &b) {
+	if (a.bytes != b.bytes)
+		return a.bytes > b.bytes;
+	return a.path < b.path;
+}
+
+// The smallest of the entries kept is on top, to be replaced by larger ones
+std::priority_queue<top_entry, std::vector<top_entry>, decltype(&is_larger)> largest{is_larger};
+std::mutex largest_mutex;
+
+void offer(const std::string &path, const diff &diff) {
+	auto bytes = summarize(diff).bytes;
+
+	std::lock_guard lock{largest_mutex};
+
+	if (largest.size() == top_count) {
+		const auto &smallest = largest.top();
+		if (bytes < smallest.bytes || (bytes == smallest.bytes && path > smallest.path))
+			return;
+
+		largest.pop();
+	}
+
+	largest.push({bytes, path, diff});
+}
+
+} // namespace anonymous
+
+void record_largest(const std::string &dir_rel, std::vector<diff> &diffs, bool recursive) {
+	if (!top_count)
+		return;
+
+	bool was_offering_all = std::exchange(offering_all, offering_all || recursive);
+
+	for (auto &diff : diffs) {
+		auto path = dir_rel.empty() ? diff.name : dir_rel + '/' + diff.name;
+
+		if (recursive) {
+			expand_sub_diffs(diff);
+
+			if (diff.sub_diffs.size()) {
+				record_largest(path, diff.sub_diffs, true);
+
+				// Directories left for later inside have been walked since
+				diff.summary = summarize(diff.sub_diffs);
+			}
+		}
+
+		// The summary stands in for the inner differences from now on
+		diff.sub_diffs.clear();
+		diff.sub_diffs.shrink_to_fit();
+		diff.lazy_sub_diffs = nullptr;
+
+		offer(path, diff);
+	}
+
+	offering_all = was_offering_all;
+}
+
+std::vector<top_entry> largest_diffs() {
+	std::unique_lock lock{largest_mutex};
+	auto copy = largest;
+	lock.unlock();
+
+	std::vector<top_entry> entries;
+	while (!copy.empty()) {
+		entries.push_back(copy.top());
+		copy.pop();
+	}
+
+	std::ranges::reverse(entries);
+	return entries;
+}
@@ -0,0 +1,66 @@
+/* Directory diff utility - Largest differences
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <tree.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Instead of keeping the whole tree of differences around, only the top_count
+// largest ones are kept. Every directory offers its differences as soon as it's
+// been walked, after which only its summary is kept in its parent.
+
+// Number of the largest differences to keep track of (0 meaning that the
+// whole tree is kept instead)
+inline size_t top_count = 0;
+
+// Cleared when the differences are offered all at once, like loaded results,
+// so that any directories walked to produce them (which are part of them)
+// aren't offered on their own
+inline bool offer_walked = true;
+
+// Set while a thread goes through differences which are offered all at once,
+// for the same reason. It's per thread, as paths may be compared concurrently.
+inline thread_local bool offering_all = false;
+
+struct top_entry {
+	std::uint64_t bytes;
+
+	// Path relative to the roots
+	std::string path;
+
+	// The difference itself, without its inner differences
+	struct diff diff;
+};
+
+// Checks whether the differences found by walking a directory are offered as
+// soon as they are, and so don't have to be kept around afterwards
+inline bool is_offering(const tree_entry &dir) {
+	// Only the differences from the reference tree are reported, rather
+	// than those found while classifying changes in a three-way diff
+	return top_count && offer_walked && !offering_all && dir.tree == 0;
+}
+
+// Offers the differences in a directory, given its path relative to the roots,
+// and drops their inner differences. If recursive, the inner differences are
+// offered first, as they haven't been (they've been loaded rather than walked).
+// Safe to call from several threads at once.
+void record_largest(const std::string &dir_rel, std::vector<diff> &diffs, bool recursive);
+
+// Returns the largest differences offered so far, largest first
+std::vector<top_entry> largest_diffs();
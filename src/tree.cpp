@@ -15,138 +15,1435 @@
  */
 
 #include <tree.hpp>
+#include <hash.hpp>
+#include <compare.hpp>
+#include <retry.hpp>
+#include <checkpoint.hpp>
+#include <top.hpp>
+#include <blockmap.hpp>
+#include <deadline.hpp>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cassert>
-#include <fstream>
+#include <chrono>
+#include <optional>
+#include <span>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <cstdint>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <exception>
 
-bool are_files_different(const fs::directory_entry &a, const fs::directory_entry &b) {
-	// a and b are bound to be of the same type at this point
-	assert(a.symlink_status().type() == b.symlink_status().type());
-	auto file_type = a.symlink_status().type();
-	
-	// TODO(qookie): Check for stat errors here
-	struct stat st_a, st_b;
-	lstat(a.path().c_str(), &st_a);
-	lstat(b.path().c_str(), &st_b);
-	
-	if (!paranoid) {
-		// Regular files of different size are bound to be different
-		if (file_type == fs::file_type::regular && a.file_size() != b.file_size())
-			return true;
-
-		// Same inode on the same device are always the same
-		if (st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino)
-			return false;
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#endif
+
+#include <xxhash.h>
+
+std::error_code last_error() {
+	return {errno, std::generic_category()};
+}
+
+// Checks whether a symlink couldn't be followed because of where it points,
+// in which case it's compared as a symlink instead
+bool is_unfollowable(int err) {
+	return err == ENOENT || err == ELOOP;
+}
+
+// Like lstat(2), or stat(2) if following symlinks
+int stat_entry(const fs::path &path, struct stat *st) {
+	return retry_syscall([&] {
+		if (follow_symlinks) {
+			int ret = timed_stat(path.c_str(), st);
+			if (ret == 0 || !is_unfollowable(errno))
+				return ret;
+		}
+
+		return timed_lstat(path.c_str(), st);
+	});
+}
+
+// Returns the status of a path, following symlinks only if asked to
+fs::file_status path_status(const fs::path &path, std::error_code &ec) {
+	auto ret = call_with_deadline([path] {
+		std::error_code ec;
+		if (follow_symlinks) {
+			auto status = fs::status(path, ec);
+			if (!ec || !is_unfollowable(ec.value()))
+				return std::pair{status, ec};
+		}
+
+		auto status = fs::symlink_status(path, ec);
+		return std::pair{status, ec};
+	});
+
+	if (!ret) {
+		ec = last_error();
+		return {};
+	}
+
+	ec = ret->second;
+	return ret->first;
+}
+
+fs::file_status entry_status(const dir_entry &dentry, std::error_code &ec) {
+	return path_status(dentry.path(), ec);
+}
+
+// Like entry_status, but also returns the size of the entry if it's a regular
+// file (0 otherwise), which comes with its type from the same stat(2) call
+fs::file_type entry_type_and_size(const dir_entry &dentry, std::uint64_t &size, std::error_code &ec) {
+	struct stat st;
+	if (stat_entry(dentry.path(), &st) < 0) {
+		ec = last_error();
+		return fs::file_type::none;
+	}
+
+	ec.clear();
+	size = S_ISREG(st.st_mode) ? st.st_size : 0;
+
+	switch (st.st_mode & S_IFMT) {
+		case S_IFREG: return fs::file_type::regular;
+		case S_IFDIR: return fs::file_type::directory;
+		case S_IFLNK: return fs::file_type::symlink;
+		case S_IFBLK: return fs::file_type::block;
+		case S_IFCHR: return fs::file_type::character;
+		case S_IFIFO: return fs::file_type::fifo;
+		case S_IFSOCK: return fs::file_type::socket;
+	}
+
+	return fs::file_type::unknown;
+}
+
+// Returns the type of an entry without following symlinks, or
+// fs::file_type::none if it can't be determined
+fs::file_type entry_type(const dir_entry &dentry) {
+	std::error_code ec;
+	return entry_status(dentry, ec).type();
+}
+
+fs::path read_symlink(const dir_entry &dentry, std::error_code &ec) {
+	auto ret = call_with_deadline([path = dentry.path()] {
+		std::error_code ec;
+		auto target = fs::read_symlink(path, ec);
+		return std::pair{target, ec};
+	});
+
+	if (!ret) {
+		ec = last_error();
+		return {};
+	}
+
+	ec = ret->second;
+	return ret->first;
+}
+
+namespace {
+
+class walk_category_impl : public std::error_category {
+public:
+	const char *name() const noexcept override {
+		return "walk";
+	}
+
+	std::string message(int err) const override {
+		switch (static_cast<walk_errc>(err)) {
+			case walk_errc::overlapping_root: return "Is the root of another tree being compared";
+		}
+
+		return "Unknown error";
+	}
+};
+
+// Identifies a file regardless of the path it's reached through
+struct file_id {
+	dev_t dev;
+	ino_t ino;
+
+	auto operator<=>(const file_id &) const = default;
+};
+
+std::optional<file_id> identify(const fs::path &path) {
+	struct stat st;
+	if (stat_entry(path, &st) < 0)
+		return std::nullopt;
+
+	return file_id{st.st_dev, st.st_ino};
+}
+
+// Identities of the roots (followed if they're symlinks), which are fixed
+// before the walk
+const std::vector<std::optional<file_id>> &root_ids() {
+	static const auto ids = [] {
+		std::vector<std::optional<file_id>> ids;
+		for (const auto &root : roots)
+			ids.push_back(identify(root));
+		return ids;
+	}();
+
+	return ids;
+}
+
+// Returns the tree other than the given one whose root is the directory, or
+// -1 if there's none
+int other_root(const file_id &id, int tree) {
+	const auto &ids = root_ids();
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (static_cast<int>(i) != tree && ids[i] == id)
+			return i;
+	}
+
+	return -1;
+}
+
+// Guards whatever is shared between walks, as the listed paths are compared
+// at the same time by diff_paths
+std::mutex walk_mutex;
+
+// Checks whether a directory is on another filesystem than the root of its
+// tree, and so isn't walked with one_file_system
+bool is_skipped_mount(const file_id &id, const tree_entry &entry) {
+	const auto &root = root_ids()[entry.tree];
+	if (!one_file_system || !root || root->dev == id.dev)
+		return false;
+
+	std::lock_guard lock{walk_mutex};
+	skipped_mounts.push_back(entry.dentry.path());
+	return true;
+}
+
+// A pair of directories walked with follow_symlinks
+struct visit {
+	// Path relative to the roots under which the pair was walked
+	std::string path;
+
+	// Set once the walk is done, along with whether the directories differ
+	bool done = false;
+	bool differs = false;
+};
+
+// Identities of a directory in the reference tree and one in another tree
+using visit_key = std::pair<file_id, file_id>;
+
+// Pairs of directories walked so far, or being walked
+std::map<visit_key, visit> visited;
+
+// Checks whether a pair of directories has been walked already (or is being
+// walked, when a symlink leads back to it), recording it as being walked if
+// not. If it's been found to differ, a reference to it is added to diffs.
+bool was_visited(const std::string &name, const tree_entry &a, const visit_key &key, int tree,
+		std::vector<diff> &diffs) {
+	// The roots are being walked for as long as the walk goes on
+	const auto &ids = root_ids();
+	if (ids[a.tree] == key.first && ids[tree] == key.second)
+		return true;
+
+	auto rel = a.dentry.path().string().substr(roots[a.tree].string().size());
+
+	std::lock_guard lock{walk_mutex};
+
+	auto [it, inserted] = visited.try_emplace(key, visit{rel});
+	if (inserted)
+		return false;
+
+	// Directories leading back to one being walked are left out, as
+	// whatever differs in them is reported where they lead to
+	if (it->second.done && it->second.differs) {
+		diffs.push_back({diff_type::contents, -1, name, "", "", {}, {tree}});
+		diffs.back().same_as = it->second.path;
+	}
+
+	return true;
+}
+
+} // namespace anonymous
+
+std::error_code make_error_code(walk_errc err) {
+	static walk_category_impl category;
+	return {static_cast<int>(err), category};
+}
+
+bool is_same_directory(const tree_entry &a, const tree_entry &b) {
+	auto a_id = identify(a.dentry.path());
+	return a_id && a_id == identify(b.dentry.path());
+}
+
+struct compare_result {
+	// Indices of the trees in which the file is different, along with
+	// what it was found to differ in
+	std::vector<std::pair<int, diff_criterion>> differing;
+
+	// Files that couldn't be compared
+	std::vector<walk_error> errors;
+
+	// Size of the largest of the differing regular files
+	std::uint64_t size = 0;
+};
+
+// Compares the reference file against the files in the other trees
+compare_result are_files_different(const tree_entry &a_entry, const std::vector<tree_entry> &bs) {
+	const auto &a = a_entry.dentry;
+
+	// a and all of bs are bound to be of the same type at this point
+	auto file_type = entry_type(a);
+
+	compare_result result;
+	auto &differing = result.differing;
+
+	struct stat st_a;
+	if (stat_entry(a.path(), &st_a) < 0) {
+		auto ec = last_error();
+		for (const auto &b : bs)
+			result.errors.push_back({b.tree, a.path(), ec});
+		return result;
 	}
 
-	update_progress(a.path());
+	if (file_type == fs::file_type::regular)
+		result.size = st_a.st_size;
+
+	std::vector<const tree_entry *> pending;
+	std::vector<std::uint64_t> pending_sizes;
+
+	for (const auto &b : bs) {
+		assert(entry_type(b.dentry) == file_type);
+
+		struct stat st_b;
+		if (stat_entry(b.dentry.path(), &st_b) < 0) {
+			result.errors.push_back({b.tree, b.dentry.path(), last_error()});
+			continue;
+		}
+
+		if (!paranoid) {
+			// Regular files of different size are bound to be different
+			// (though they have to be read to map the blocks they differ in)
+			if (file_type == fs::file_type::regular && st_a.st_size != st_b.st_size && !block_map_size) {
+				auto criterion = quick_compare == quick_check::none
+					? diff_criterion::contents : diff_criterion::size;
+
+				differing.push_back({b.tree, criterion});
+				result.size = std::max<std::uint64_t>(result.size, st_b.st_size);
+				continue;
+			}
+
+			// Same inode on the same device are always the same
+			if (st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino)
+				continue;
+		}
+
+		// Regular files of the same size are taken to be the same in quick
+		// modes, unless their modification times differ
+		if (file_type == fs::file_type::regular && quick_compare != quick_check::none) {
+			if (quick_compare == quick_check::mtime && st_a.st_mtim.tv_sec != st_b.st_mtim.tv_sec)
+				differing.push_back({b.tree, diff_criterion::mtime});
+			continue;
+		}
+
+		// Only special files (!symlink && !regular) get here
+		// Same device numbers of special files means they are the same
+		if (file_type != fs::file_type::symlink && file_type != fs::file_type::regular) {
+			if (st_a.st_rdev != st_b.st_rdev)
+				differing.push_back({b.tree, diff_criterion::contents});
+			continue;
+		}
+
+		pending.push_back(&b);
+		pending_sizes.push_back(st_b.st_size);
+	}
+
+	if (pending.empty())
+		return result;
+
+	update_progress(a.path(), a_entry.tree);
 
 	// Same target means symlinks are the same
 	if (file_type == fs::file_type::symlink) {
-		return fs::read_symlink(a) != fs::read_symlink(b);
+		std::error_code ec;
+		auto a_target = read_symlink(a, ec);
+		if (ec) {
+			for (auto b : pending)
+				result.errors.push_back({b->tree, a.path(), ec});
+			return result;
+		}
+
+		for (auto b : pending) {
+			auto b_target = read_symlink(b->dentry, ec);
+			if (ec)
+				result.errors.push_back({b->tree, b->dentry.path(), ec});
+			else if (a_target != b_target)
+				differing.push_back({b->tree, diff_criterion::contents});
+		}
+
+		std::ranges::sort(differing);
+		return result;
+	}
+
+	// Same digests means regular files are the same. Each file is read on its
+	// own from start to end, which avoids seeking back and forth between the
+	// files if they're on the same disk.
+	if (content_compare == compare_mode::hash) {
+		auto a_digest = hash_file(hash_algo, a.path());
+		if (!a_digest) {
+			auto ec = last_error();
+			for (auto b : pending)
+				result.errors.push_back({b->tree, a.path(), ec});
+			return result;
+		}
+
+		for (auto b : pending) {
+			auto b_digest = hash_file(hash_algo, b->dentry.path());
+
+			if (!b_digest)
+				result.errors.push_back({b->tree, b->dentry.path(), last_error()});
+			else if (*a_digest != *b_digest)
+				differing.push_back({b->tree, diff_criterion::contents});
+		}
+
+		std::ranges::sort(differing);
+		return result;
+	}
+
+	// Same contents means regular files are the same. The reference file is
+	// read only once, with every chunk being compared against all the other
+	// files that haven't been found to be different yet.
+	// Reused across calls, like the buffers, to avoid allocating on every
+	// comparison
+	thread_local std::vector<fs::path> b_paths;
+	thread_local std::vector<content_result> contents;
+
+	b_paths.resize(pending.size());
+	for (size_t i = 0; i < pending.size(); i++)
+		b_paths[i] = pending[i]->dentry.path();
+
+	are_contents_different(a.path(), b_paths, contents);
+	for (size_t i = 0; i < pending.size(); i++) {
+		if (contents[i].error) {
+			result.errors.push_back({pending[i]->tree, contents[i].error_path, contents[i].error});
+		} else if (contents[i].different) {
+			differing.push_back({pending[i]->tree, diff_criterion::contents});
+			result.size = std::max(result.size, pending_sizes[i]);
+
+			// Only the differences from the reference tree are mapped,
+			// rather than those found while classifying changes
+			if (block_map_size && a_entry.tree == 0) {
+				auto rel = a.path().string().substr(roots[0].string().size());
+				write_block_map(pending[i]->tree, rel, st_a.st_size, pending_sizes[i], contents[i].blocks);
+			}
+		}
+	}
+
+	std::ranges::sort(differing);
+	return result;
+}
+
+// Returns the physical location of the first extent of a file, if any
+std::optional<std::uint64_t> first_physical_block(const fs::path &path) {
+#ifdef __linux__
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | (follow_symlinks ? 0 : O_NOFOLLOW));
+	if (fd < 0)
+		return std::nullopt;
+
+	alignas(struct fiemap) char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+	auto map = reinterpret_cast<struct fiemap *>(buf);
+	map->fm_length = FIEMAP_MAX_OFFSET;
+	map->fm_extent_count = 1;
+
+	int ret = ioctl(fd, FS_IOC_FIEMAP, map);
+	close(fd);
+
+	if (ret < 0 || !map->fm_mapped_extents)
+		return std::nullopt;
+
+	return map->fm_extents[0].fe_physical;
+#else
+	(void)path;
+	return std::nullopt;
+#endif
+}
+
+// Sorts the names of the children of a directory in the order they're laid
+// out on disk in the reference tree (or the first tree they exist in), so
+// that their metadata and contents are accessed mostly sequentially. Only the
+// children of the directory are sorted, the directories among them being
+// walked in the same order.
+void sort_for_locality(std::vector<std::string> &names,
+		const std::unordered_map<std::string, dir_entry> &a_children,
+		const std::vector<std::unordered_map<std::string, dir_entry>> &b_children) {
+	// Inode numbers come straight from the directory listing, without
+	// needing to stat every entry
+	auto inode = [&] (const std::string &name) -> ino_t {
+		if (auto it = a_children.find(name); it != a_children.end())
+			return it->second.ino();
+
+		for (const auto &children : b_children) {
+			if (auto it = children.find(name); it != children.end())
+				return it->second.ino();
+		}
+
+		return 0;
+	};
+
+	// Regular files are ordered by the location of their contents and go
+	// first, everything else follows in inode order
+	std::unordered_map<std::string, std::pair<int, std::uint64_t>> keys;
+	for (const auto &name : names) {
+		std::pair<int, std::uint64_t> key{1, inode(name)};
+
+		if (traversal_order == walk_order::physical) {
+			auto a_it = a_children.find(name);
+			if (a_it != a_children.end() && entry_type(a_it->second) == fs::file_type::regular) {
+				if (auto block = first_physical_block(a_it->second.path()))
+					key = {0, *block};
+			}
+		}
+
+		keys.emplace(name, key);
 	}
 
-	// Same contents means regular files are the same
-	if (file_type == fs::file_type::regular) {
-		std::ifstream a_ifs{a.path(), std::ios::binary};
-		std::ifstream b_ifs{b.path(), std::ios::binary};
+	std::ranges::sort(names, {}, [&] (const auto &name) { return keys.at(name); });
+}
+
+// Records an entry that couldn't be read, or gives up on the whole walk
+void report_error(std::vector<diff> &diffs, const std::string &name, const walk_error &err) {
+	if (!keep_going)
+		throw err;
+
+	error_count++;
+	diffs.push_back({diff_type::error, -1, name, err.path, "", {}, {err.tree}, false, err.message()});
+}
+
+std::vector<diff> walk_directory(const tree_entry &a_dentry, const std::vector<tree_entry> &b_dentries, bool stop_early);
+
+// Number of levels below the root the entry is
+int entry_depth(const tree_entry &entry) {
+	auto rel = entry.dentry.path().string().substr(roots[entry.tree].string().size());
+	return rel.empty() ? 0 : std::ranges::count(rel, '/') + 1;
+}
+
+// Produces the inner differences of a directory which has only been checked
+// for whether it differs
+std::function<std::vector<diff>()> continue_walk(const std::string &name, tree_entry a, std::vector<tree_entry> bs) {
+	return [name, a = std::move(a), bs = std::move(bs)] () -> std::vector<diff> {
+		try {
+			return diff_trees(a, bs);
+		} catch (const walk_error &err) {
+			// Whoever asked for the differences can't do anything about it
+			error_count++;
+			return {{diff_type::error, -1, name, err.path, "", {}, {err.tree}, false, err.message()}};
+		}
+	};
+}
+
+// Computes the differences between the reference entry and the entries of
+// the same name in the other trees, and appends them to diffs
+void diff_entry(const std::string &name, const tree_entry *a_child,
+		std::vector<tree_entry> b_present, std::vector<int> b_missing,
+		std::vector<diff> &diffs) {
+	if (!a_child) {
+		std::vector<int> trees;
+		for (const auto &b : b_present)
+			trees.push_back(b.tree);
 
-		char a_buf[4096], b_buf[4096];
-		while (true) {
-			a_ifs.read(a_buf, 4096);
-			auto a_count = a_ifs.gcount();
+		// Added entries aren't looked at by the walk, so their sizes
+		// are unknown, rather than looked up for the summaries alone
+		diffs.push_back({diff_type::missing, 0, name, "", "", {}, std::move(trees)});
+		return;
+	}
 
-			b_ifs.read(b_buf, 4096);
-			auto b_count = b_ifs.gcount();
+	// Only follows symlinks if asked to. Prevents confusion caused by
+	// is_directory() and is_symlink() both being true because the former
+	// follows the symlink and the latter doesn't. The size is that of the
+	// entry removed from, or retyped in the other trees.
+	std::error_code ec;
+	std::uint64_t a_size = 0;
+	auto a_type = entry_type_and_size(a_child->dentry, a_size, ec);
 
-			if (std::string_view{a_buf, static_cast<size_t>(a_count)} !=
-					std::string_view{b_buf, static_cast<size_t>(b_count)})
+	if (b_missing.size())
+		diffs.push_back({diff_type::missing, 1, name, "", "", {}, std::move(b_missing), false, "", a_size});
+
+	if (ec) {
+		for (const auto &b : b_present)
+			report_error(diffs, name, {b.tree, a_child->dentry.path(), ec});
+		return;
+	}
+
+	std::vector<tree_entry> b_same_type;
+	std::vector<int> b_other_type;
+
+	for (auto &b : b_present) {
+		auto b_type = entry_status(b.dentry, ec).type();
+		if (ec)
+			report_error(diffs, name, {b.tree, b.dentry.path(), ec});
+		else if (b_type != a_type)
+			b_other_type.push_back(b.tree);
+		else
+			b_same_type.push_back(std::move(b));
+	}
+
+	if (b_other_type.size())
+		diffs.push_back({diff_type::file_type, -1, name, "", "", {}, std::move(b_other_type), false, "",
+				a_size});
+
+	if (b_same_type.empty())
+		return;
+
+	if (a_type == fs::file_type::directory) {
+		// A directory which is the root of another tree (as when one of the
+		// roots is inside another) would be compared against itself
+		auto a_id = identify(a_child->dentry.path());
+		if (a_id && other_root(*a_id, a_child->tree) >= 0) {
+			for (const auto &b : b_same_type)
+				report_error(diffs, name, {b.tree, a_child->dentry.path(), walk_errc::overlapping_root});
+			return;
+		}
+
+		if (a_id && is_skipped_mount(*a_id, *a_child))
+			return;
+
+		// With follow_symlinks, the pairs of directories recorded as being
+		// walked here
+		std::vector<std::pair<int, visit_key>> visiting;
+
+		std::erase_if(b_same_type, [&] (const tree_entry &b) {
+			auto b_id = identify(b.dentry.path());
+			if (!b_id)
+				return false;
+
+			if (other_root(*b_id, b.tree) >= 0) {
+				report_error(diffs, name, {b.tree, b.dentry.path(), walk_errc::overlapping_root});
 				return true;
+			}
+
+			if (is_skipped_mount(*b_id, b))
+				return true;
+
+			// The same directory (like through a bind mount) can't differ
+			if (!paranoid && b_id == a_id)
+				return true;
+
+			// Directories reached through several symlinks are only walked
+			// once, which also keeps symlinks in a cycle from being followed
+			// around it forever
+			if (!follow_symlinks || !a_id)
+				return false;
+
+			visit_key key{*a_id, *b_id};
+			if (was_visited(name, *a_child, key, b.tree, diffs))
+				return true;
+
+			visiting.push_back({b.tree, key});
+			return false;
+		});
+
+		if (b_same_type.empty())
+			return;
+
+		std::vector<diff> sub_diff;
 
-			if (a_count < 4096 || b_count < 4096)
+		bool lazy = lazy_depth >= 0 && entry_depth(*a_child) >= lazy_depth;
+
+		// Trees in which the directory can't be listed are left out
+		while (!b_same_type.empty()) {
+			try {
+				if (lazy) {
+					// Errors found while checking whether the directory
+					// differs are reported once it's walked in full
+					size_t saved_error_count = error_count;
+					sub_diff = walk_directory(*a_child, b_same_type, true);
+					error_count = saved_error_count;
+				} else {
+					sub_diff = diff_trees(*a_child, b_same_type);
+				}
 				break;
+			} catch (const walk_error &err) {
+				if (!keep_going)
+					throw;
+
+				if (err.tree == a_child->tree) {
+					for (const auto &b : b_same_type)
+						report_error(diffs, name, {b.tree, err.path, err.ec});
+					return;
+				}
+
+				report_error(diffs, name, err);
+				std::erase_if(b_same_type, [&] (const auto &b) { return b.tree == err.tree; });
+			}
 		}
 
-		return false;
+		// Directories which couldn't be listed are taken to differ as well
+		std::unique_lock lock{walk_mutex};
+		for (const auto &[tree, key] : visiting) {
+			auto &visit = visited.at(key);
+			visit.done = true;
+			visit.differs = std::ranges::find(b_same_type, tree, &tree_entry::tree) == b_same_type.end()
+				|| std::ranges::any_of(sub_diff, [&] (const diff &sub) {
+					return std::ranges::find(sub.trees, tree) != sub.trees.end();
+				});
+		}
+		lock.unlock();
+
+		if (sub_diff.size()) {
+			std::vector<int> trees;
+			for (const auto &sub : sub_diff)
+				trees.insert(trees.end(), sub.trees.begin(), sub.trees.end());
+
+			std::ranges::sort(trees);
+			trees.erase(std::unique(trees.begin(), trees.end()), trees.end());
+
+			auto b_path = std::ranges::find(b_same_type, trees.front(), &tree_entry::tree)->dentry.path();
+
+			if (lazy) {
+				diffs.push_back({diff_type::contents, -1, name,
+						a_child->dentry.path(), b_path, {}, std::move(trees)});
+
+				auto &entry = diffs.back();
+				entry.lazy_sub_diffs = continue_walk(name, *a_child, std::move(b_same_type));
+				entry.lazy_walk = true;
+				return;
+			}
+
+			// The inner differences have been offered already, if
+			// only the largest differences are kept
+			auto summary = summarize(sub_diff);
+			if (is_offering(*a_child)) {
+				sub_diff.clear();
+				sub_diff.shrink_to_fit();
+			}
+
+			diffs.push_back({diff_type::contents, -1, name,
+					a_child->dentry.path(), b_path, std::move(sub_diff), std::move(trees)});
+			diffs.back().summary = summary;
+		}
+
+		return;
 	}
 
-	// Only special files (!symlink && !regular) get here
-	// Same device numbers of special files means they are the same
-	return st_a.st_rdev != st_b.st_rdev;
+	auto result = are_files_different(*a_child, b_same_type);
+	for (const auto &err : result.errors)
+		report_error(diffs, name, err);
+
+	// Files flagged by different criteria in different trees are reported
+	// separately, for each criterion
+	for (auto criterion : {diff_criterion::contents, diff_criterion::size, diff_criterion::mtime}) {
+		std::vector<int> trees;
+		for (auto [tree, flagged_by] : result.differing) {
+			if (flagged_by == criterion)
+				trees.push_back(tree);
+		}
+
+		if (trees.size()) {
+			diffs.push_back({diff_type::contents, -1, name, "", "", {}, std::move(trees), false, "",
+					result.size, criterion});
+		}
+	}
 }
 
-std::vector<diff> diff_trees(const fs::directory_entry &a_dentry, const fs::directory_entry &b_dentry) {
-	// Build a union of the sets of children from both directories
+// Checks whether two entries (which may be directories) differ in any way
+bool are_entries_different(const tree_entry &a, const tree_entry &b) {
+	auto a_type = entry_type(a.dentry);
+	if (a_type == fs::file_type::none || a_type != entry_type(b.dentry))
+		return true;
+
+	if (a_type == fs::file_type::directory)
+		return (paranoid || !is_same_directory(a, b)) && !diff_trees(a, {b}).empty();
+
+	auto result = are_files_different(a, {b});
+	return !result.differing.empty() || !result.errors.empty();
+}
+
+// In a three-way diff, checks whether an entry changed in both trees was
+// changed the same way in both, and marks the changes as conflicting if not
+void classify_changes(std::span<diff> entries, const std::vector<tree_entry> &b_present) {
+	bool changed_a = false, changed_b = false;
+	for (const auto &entry : entries) {
+		// Entries that couldn't be compared can't be classified either
+		if (entry.type == diff_type::error)
+			return;
+
+		changed_a |= std::ranges::find(entry.trees, 1) != entry.trees.end();
+		changed_b |= std::ranges::find(entry.trees, 2) != entry.trees.end();
+	}
+
+	if (!changed_a || !changed_b)
+		return;
+
+	bool conflict = true;
+
+	if (entries.size() == 1) {
+		const auto &entry = entries.front();
+
+		// Differing directories are resolved by their children
+		if (has_sub_diffs(entry))
+			return;
+
+		if (entry.type == diff_type::missing && entry.n == 1) {
+			// Removed in both
+			conflict = false;
+		} else {
+			// Added, or changed in both, so the results have to be compared
+			auto a_it = std::ranges::find(b_present, 1, &tree_entry::tree);
+			auto b_it = std::ranges::find(b_present, 2, &tree_entry::tree);
+			assert(a_it != b_present.end() && b_it != b_present.end());
+
+			conflict = are_entries_different(*a_it, *b_it);
+		}
+	}
+
+	if (conflict) {
+		for (auto &entry : entries)
+			entry.conflict = true;
+	}
+}
+
+// Checks whether an entry of a directory of the reference tree, the given
+// number of levels deep, is compared by this shard
+bool is_in_shard(const std::string &dir_rel, const std::string &name, int depth, bool is_dir) {
+	if (depth > shard_depth || (depth < shard_depth && is_dir))
+		return true;
+
+	auto rel = dir_rel.empty() ? name : dir_rel + '/' + name;
+	return XXH3_64bits(rel.data(), rel.size()) % shard_count == shard_index;
+}
+
+// Lists the children of a directory, retrying if interrupted
+void list_directory(const tree_entry &dir,
+		std::unordered_map<std::string, dir_entry> &children,
+		std::unordered_set<std::string> &comb_child) {
+	auto backoff = initial_backoff;
+
+	for (int retries = 0; ; retries++) {
+		// The whole listing is a single operation, as far as deadlines go
+		auto ret = call_with_deadline([path = dir.dentry.path()] {
+			std::vector<dir_entry> entries;
+
+			DIR *dirp = opendir(path.c_str());
+			if (!dirp)
+				return std::pair{std::move(entries), last_error()};
+
+			std::error_code ec;
+			while (true) {
+				errno = 0;
+				auto ent = readdir(dirp);
+				if (!ent) {
+					if (errno)
+						ec = last_error();
+					break;
+				}
+
+				std::string_view name = ent->d_name;
+				if (name != "." && name != "..")
+					entries.emplace_back(path / name, ent->d_ino);
+			}
+
+			closedir(dirp);
+			return std::pair{std::move(entries), ec};
+		});
+
+		auto ec = ret ? ret->second : last_error();
+		if (!ec) {
+			for (auto &entry : ret->first) {
+				auto name = entry.path().filename();
+				comb_child.emplace(name);
+				children.emplace(name, std::move(entry));
+			}
+			return;
+		}
+
+		if (!is_transient_error(ec.value()) || retries == max_retries)
+			throw walk_error{dir.tree, dir.dentry.path(), ec};
+
+		if (ec.value() != EINTR) {
+			std::this_thread::sleep_for(backoff);
+			backoff *= 2;
+		}
+	}
+}
+
+// Starts reading the files about to be compared in the background, keeping
+// as much data in flight as can be compared within the lookahead time at the
+// currently observed compare throughput
+class prefetcher {
+public:
+	// Adds the files of an entry whose contents are going to be compared
+	void push(std::vector<fs::path> paths, std::uintmax_t size) {
+		queue_.push_back({std::move(paths), size});
+	}
+
+	// Adds an entry whose contents aren't going to be compared
+	void skip() {
+		queue_.push_back({});
+	}
+
+	// Issues the readahead for the entries following the current one
+	void advance(size_t current) {
+		// Whatever was read ahead for this entry and the ones before it is
+		// about to be, or has already been consumed
+		for (; consumed_ <= current; consumed_++) {
+			if (consumed_ < issued_)
+				in_flight_ -= item_bytes(queue_[consumed_]);
+		}
+
+		issued_ = std::max(issued_, current + 1);
+
+		auto budget = std::clamp(throughput_.load(std::memory_order_relaxed) * lookahead, min_budget, max_budget);
+
+		while (issued_ < queue_.size() && in_flight_ < budget) {
+			auto &item = queue_[issued_++];
+
+			for (const auto &path : item.paths) {
+				int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | (follow_symlinks ? 0 : O_NOFOLLOW));
+				if (fd < 0)
+					continue;
+
+				posix_fadvise(fd, 0, std::min(item.size, window), POSIX_FADV_WILLNEED);
+				close(fd);
+			}
+
+			in_flight_ += item_bytes(item);
+		}
+	}
+
+	// Records how long it took to compare the current entry
+	void record(size_t current, std::chrono::steady_clock::duration elapsed) {
+		const auto &item = queue_[current];
+		if (item.paths.empty())
+			return;
+
+		std::chrono::duration<double> secs = elapsed;
+		if (secs.count() <= 0)
+			return;
+
+		// Samples recorded at the same time may overwrite each other,
+		// which only loses a little precision in the estimate
+		auto sample = item.size * item.paths.size() / secs.count();
+		auto throughput = throughput_.load(std::memory_order_relaxed);
+		throughput_.store(throughput * 0.8 + sample * 0.2, std::memory_order_relaxed);
+	}
+
+private:
+	struct item {
+		std::vector<fs::path> paths;
+		std::uintmax_t size = 0;
+	};
+
+	// Only the beginning of large files is prefetched, as reading them
+	// sequentially triggers the kernel's own readahead anyway
+	static constexpr std::uintmax_t window = 4 * 1024 * 1024;
+
+	static constexpr double lookahead = 0.25;
+	static constexpr double min_budget = 1024 * 1024;
+	static constexpr double max_budget = 512 * 1024 * 1024;
+
+	static double item_bytes(const item &item) {
+		return std::min(item.size, window) * item.paths.size();
+	}
+
+	std::vector<item> queue_;
+	size_t consumed_ = 0;
+	size_t issued_ = 0;
+	double in_flight_ = 0;
+
+	// Shared by all directories, and so by any walks running at the same
+	// time, starting with a conservative guess
+	static inline std::atomic<double> throughput_ = 64 * 1024 * 1024;
+};
+
+// Compares the contents of the directories. If stopping early, only as many
+// entries are compared as it takes to find a difference in every tree.
+std::vector<diff> walk_directory(const tree_entry &a_dentry, const std::vector<tree_entry> &b_dentries, bool stop_early) {
+	// Build a union of the sets of children from all directories
 	std::unordered_set<std::string> comb_child;
-	std::unordered_map<std::string, fs::directory_entry> a_children, b_children;
+	std::unordered_map<std::string, dir_entry> a_children;
+	std::vector<std::unordered_map<std::string, dir_entry>> b_children(b_dentries.size());
+
+	list_directory(a_dentry, a_children, comb_child);
+
+	for (size_t i = 0; i < b_dentries.size(); i++)
+		list_directory(b_dentries[i], b_children[i], comb_child);
 
-	for (const auto &child_dentry : fs::directory_iterator{a_dentry}) {
-		auto name = child_dentry.path().filename();
-		comb_child.emplace(name);
-		a_children.emplace(name, child_dentry);
+	std::vector<std::string> names{comb_child.begin(), comb_child.end()};
+
+	// Leave out the entries which neither match the --only patterns, nor
+	// are directories that could have matching entries inside, so that
+	// they're never walked
+	if (!is_only_included(a_dentry.dentry.path(), a_dentry.tree)) {
+		// Every name is in at least one of the trees
+		auto first_entry = [&] (const std::string &name) -> tree_entry {
+			if (auto it = a_children.find(name); it != a_children.end())
+				return {a_dentry.tree, it->second};
+
+			for (size_t i = 0; ; i++) {
+				if (auto it = b_children[i].find(name); it != b_children[i].end())
+					return {b_dentries[i].tree, it->second};
+			}
+		};
+
+		std::erase_if(names, [&] (const auto &name) {
+			auto entry = first_entry(name);
+
+			switch (match_only(entry.dentry.path(), entry.tree)) {
+				case only_match::none: return true;
+				case only_match::partial: return entry_type(entry.dentry) != fs::file_type::directory;
+				case only_match::full: return false;
+			}
+
+			return false;
+		});
+	}
+
+	// Only the walk of the reference tree is split between shards
+	if (shard_count > 1 && a_dentry.tree == 0) {
+		auto dir_rel = a_dentry.dentry.path().string().substr(roots[0].string().size());
+		int depth = dir_rel.empty() ? 1 : std::ranges::count(dir_rel, '/') + 2;
+
+		std::erase_if(names, [&] (const auto &name) {
+			auto a_it = a_children.find(name);
+			bool is_dir = a_it != a_children.end() && entry_type(a_it->second) == fs::file_type::directory;
+			return !is_in_shard(dir_rel, name, depth, is_dir);
+		});
 	}
 
-	for (const auto &child_dentry : fs::directory_iterator{b_dentry}) {
-		auto name = child_dentry.path().filename();
-		comb_child.emplace(name);
-		b_children.emplace(name, child_dentry);
+	if (traversal_order != walk_order::none) {
+		sort_for_locality(names, a_children, b_children);
+	} else if (follow_symlinks) {
+		// Directories reached through several symlinks are walked under
+		// the first of their paths in name order, regardless of hashing
+		std::ranges::sort(names);
+	}
+
+	// Queue up the regular files which are going to have their contents compared
+	prefetcher prefetch_queue;
+	if (prefetch) {
+		auto file_size = [] (const dir_entry &dentry, std::error_code &ec) -> std::uintmax_t {
+			struct stat st;
+			if (stat_entry(dentry.path(), &st) < 0) {
+				ec = last_error();
+				return 0;
+			}
+
+			return st.st_size;
+		};
+
+		for (const auto &name : names) {
+			auto a_it = a_children.find(name);
+			if (a_it == a_children.end() || entry_type(a_it->second) != fs::file_type::regular) {
+				prefetch_queue.skip();
+				continue;
+			}
+
+			// Errors are reported once the files are actually compared
+			std::error_code ec;
+			auto size = file_size(a_it->second, ec);
+
+			std::vector<fs::path> paths;
+			for (const auto &children : b_children) {
+				auto b_it = children.find(name);
+				if (b_it != children.end()
+						&& entry_type(b_it->second) == fs::file_type::regular
+						&& (paranoid || file_size(b_it->second, ec) == size))
+					paths.push_back(b_it->second.path());
+			}
+
+			if (ec || paths.empty()) {
+				prefetch_queue.skip();
+				continue;
+			}
+
+			paths.push_back(a_it->second.path());
+			prefetch_queue.push(std::move(paths), size);
+		}
 	}
 
 	std::vector<diff> diffs;
 
+	// Trees in which a difference has been found, when stopping early
+	std::vector<bool> differing(b_dentries.size());
+
 	// Go through each known file and check if they are the same or not
-	for (const auto &name : comb_child) {
+	for (size_t idx = 0; idx < names.size(); idx++) {
+		const auto &name = names[idx];
 		auto a_it = a_children.find(name);
-		auto b_it = b_children.find(name);
 
-		if (a_it != a_children.end() && should_ignore_file(a_it->second.path(), true))
+		if (prefetch)
+			prefetch_queue.advance(idx);
+
+		if (a_it != a_children.end() && should_ignore_file(a_it->second.path(), a_dentry.tree))
 			continue;
 
-		if (b_it != a_children.end() && should_ignore_file(b_it->second.path(), false))
+		std::vector<tree_entry> b_present;
+		std::vector<int> b_missing;
+
+		bool ignored = false;
+		for (size_t i = 0; i < b_dentries.size(); i++) {
+			auto tree = b_dentries[i].tree;
+			if (differing[i])
+				continue;
+
+			auto b_it = b_children[i].find(name);
+
+			if (b_it == b_children[i].end()) {
+				b_missing.push_back(tree);
+				continue;
+			}
+
+			if (should_ignore_file(b_it->second.path(), tree)) {
+				ignored = true;
+				break;
+			}
+
+			b_present.push_back({tree, b_it->second});
+		}
+
+		if (ignored)
 			continue;
 
-		if ((a_it == a_children.end()) ^ (b_it == b_children.end())) {
-			diffs.push_back({diff_type::missing,
-					a_it == a_children.end() ? 0 : 1,
-					name});
+		// Every tree with the entry is already known to differ (when stopping early)
+		if (b_present.empty() && (b_missing.empty() || a_it == a_children.end()))
 			continue;
+
+		std::optional<tree_entry> a_child;
+		if (a_it != a_children.end())
+			a_child = tree_entry{a_dentry.tree, a_it->second};
+
+		auto start = std::chrono::steady_clock::now();
+
+		auto first = diffs.size();
+		diff_entry(name, a_child ? &*a_child : nullptr, b_present, std::move(b_missing), diffs);
+
+		if (prefetch)
+			prefetch_queue.record(idx, std::chrono::steady_clock::now() - start);
+
+		if (stop_early) {
+			for (const auto &diff : std::span{diffs}.subspan(first)) {
+				for (auto tree : diff.trees) {
+					auto it = std::ranges::find(b_dentries, tree, &tree_entry::tree);
+					differing[it - b_dentries.begin()] = true;
+				}
+			}
+
+			if (std::ranges::all_of(differing, std::identity{}))
+				break;
+		} else if (three_way) {
+			classify_changes(std::span{diffs}.subspan(first), b_present);
+		}
+	}
+
+	// Report the differences in the same order regardless of the order in
+	// which the entries were processed
+	std::ranges::stable_sort(diffs, {}, &diff::name);
+
+	return diffs;
+}
+
+std::vector<diff> diff_trees(const tree_entry &a_dentry, const std::vector<tree_entry> &b_dentries) {
+	bool offering = is_offering(a_dentry);
+	auto rel = a_dentry.dentry.path().string().substr(roots[a_dentry.tree].string().size());
+
+	if (auto diffs = load_checkpoint(a_dentry)) {
+		if (offering)
+			record_largest(rel, *diffs, true);
+		return std::move(*diffs);
+	}
+
+	auto diffs = walk_directory(a_dentry, b_dentries, false);
+	save_checkpoint(a_dentry, diffs);
+
+	// The subdirectories have offered their own differences already
+	if (offering)
+		record_largest(rel, diffs, false);
+
+	return diffs;
+}
+
+std::vector<diff> diff_directory(const fs::path &a_path) {
+	auto rel = a_path.lexically_relative(roots[0]);
+	tree_entry a{0, dir_entry{a_path}};
+
+	// The directory only differs in the trees in which it's a directory as well
+	std::vector<tree_entry> bs;
+	for (size_t i = 1; i < roots.size(); i++) {
+		dir_entry dentry{roots[i] / rel};
+		if (entry_type(dentry) == fs::file_type::directory)
+			bs.push_back({static_cast<int>(i), std::move(dentry)});
+	}
+
+	return continue_walk(rel.filename(), std::move(a), std::move(bs))();
+}
+
+namespace {
+
+// One of the paths given to diff_paths, or a directory above one
+struct path_node {
+	// Ordered by name, so that the paths are compared in path order, with
+	// the ones in the same directory mostly one after another
+	std::map<std::string, path_node> children;
+
+	bool listed = false;
+
+	// Differences found in the entry itself (not inside it, for directories
+	// above the listed paths)
+	std::vector<diff> diffs;
+
+	// For directories above the listed paths, the entries which have been
+	// looked into (the ones which are directories in every tree)
+	std::optional<tree_entry> a_dir;
+	std::vector<tree_entry> b_dirs;
+};
+
+// The paths inside listed directories are compared along with them
+void drop_inside_listed(path_node &node) {
+	if (node.listed)
+		node.children.clear();
+
+	for (auto &[name, child] : node.children)
+		drop_inside_listed(child);
+}
+
+// Looks up an entry given its path relative to the roots in the reference
+// tree and in the given other trees, sorting the latter by whether they have
+// it. Returns false if it can't be looked up in the reference tree.
+bool look_up(const std::string &name, const std::string &rel, const std::vector<tree_entry> &b_dirs,
+		std::optional<tree_entry> &a, std::vector<tree_entry> &b_present, std::vector<int> &b_missing,
+		std::vector<diff> &diffs) {
+	auto exists = [&] (int tree, std::error_code &ec) {
+		auto path = roots[tree] / rel;
+		path_status(path, ec);
+
+		if (ec == std::errc::no_such_file_or_directory || ec == std::errc::not_a_directory) {
+			ec.clear();
+			return std::optional<tree_entry>{};
 		}
 
-		assert(a_it != a_children.end());
-		assert(b_it != b_children.end());
+		if (ec)
+			return std::optional<tree_entry>{};
 
-		auto &a_child = a_it->second;
-		auto &b_child = b_it->second;
+		return std::optional{tree_entry{tree, dir_entry{std::move(path)}}};
+	};
 
-		// Use symlink_status instead of status to avoid following symlinks.
-		// Prevents confusion caused by is_directory() and is_symlink() both
-		// being true because the former follows the symlink and the latter doesn't.
-		auto a_type = a_child.symlink_status().type();
-		auto b_type = b_child.symlink_status().type();
+	std::error_code ec;
+	a = exists(0, ec);
+	if (ec) {
+		for (const auto &b : b_dirs)
+			report_error(diffs, name, {b.tree, roots[0] / rel, ec});
+		return false;
+	}
+
+	for (const auto &b : b_dirs) {
+		auto entry = exists(b.tree, ec);
+		if (ec)
+			report_error(diffs, name, {b.tree, roots[b.tree] / rel, ec});
+		else if (entry)
+			b_present.push_back(std::move(*entry));
+		else
+			b_missing.push_back(b.tree);
+	}
+
+	return true;
+}
+
+// Listed paths are compared by at most this many threads, as more would mostly
+// wait on the same disks
+constexpr size_t max_path_threads = 16;
+
+// A listed path, compared by one of the threads
+struct path_job {
+	path_node *node;
+	std::string name, rel;
+	std::vector<tree_entry> b_dirs;
+};
+
+// Compares a listed path the same way as if it had been found while walking
+// the directory it's in
+void diff_listed(const path_job &job) {
+	auto &diffs = job.node->diffs;
+
+	std::optional<tree_entry> a;
+	std::vector<tree_entry> b_present;
+	std::vector<int> b_missing;
+	if (!look_up(job.name, job.rel, job.b_dirs, a, b_present, b_missing, diffs))
+		return;
+
+	if (a && should_ignore_file(a->dentry.path(), a->tree))
+		return;
+	for (const auto &b : b_present) {
+		if (should_ignore_file(b.dentry.path(), b.tree))
+			return;
+	}
 
-		if (a_type != b_type) {
-			diffs.push_back({diff_type::file_type, -1, name});
+	// Not in any of the trees
+	if (!a && b_present.empty())
+		return;
+
+	diff_entry(job.name, a ? &*a : nullptr, b_present, std::move(b_missing), diffs);
+
+	if (three_way)
+		classify_changes(diffs, b_present);
+}
+
+// Checks the directories above the listed paths, and queues up the listed
+// paths inside them to be compared
+void plan_paths(path_node &dir, const std::string &dir_rel, const std::vector<tree_entry> &b_dirs,
+		std::vector<path_job> &jobs) {
+	for (auto &[name, node] : dir.children) {
+		auto rel = dir_rel.empty() ? name : dir_rel + '/' + name;
+
+		if (node.listed) {
+			jobs.push_back({&node, name, rel, b_dirs});
 			continue;
 		}
 
-		if (a_type == fs::file_type::directory) {
-			auto sub_diff = diff_trees(a_child, b_child);
-			if (sub_diff.size()) {
-				diffs.push_back({diff_type::contents, -1, name,
-						a_child.path(), b_child.path(), std::move(sub_diff)});
-			}
+		std::optional<tree_entry> a;
+		std::vector<tree_entry> b_present;
+		std::vector<int> b_missing;
+		if (!look_up(name, rel, b_dirs, a, b_present, b_missing, node.diffs))
+			continue;
 
+		// Whatever isn't a directory in the reference tree is compared as it
+		// would be by a walk, as the listed paths aren't there
+		if (!a || entry_type(a->dentry) != fs::file_type::directory) {
+			if (a || b_present.size())
+				diff_entry(name, a ? &*a : nullptr, std::move(b_present), std::move(b_missing), node.diffs);
 			continue;
 		}
 
-		if (are_files_different(a_child, b_child)) {
-			diffs.push_back({diff_type::contents, -1, name});
+		if (b_missing.size())
+			node.diffs.push_back({diff_type::missing, 1, name, "", "", {}, std::move(b_missing)});
+
+		std::vector<int> b_other_type;
+		for (auto &b : b_present) {
+			if (entry_type(b.dentry) == fs::file_type::directory)
+				node.b_dirs.push_back(std::move(b));
+			else
+				b_other_type.push_back(b.tree);
+		}
+
+		if (b_other_type.size())
+			node.diffs.push_back({diff_type::file_type, -1, name, "", "", {}, std::move(b_other_type)});
+
+		if (node.b_dirs.size()) {
+			node.a_dir = std::move(a);
+			plan_paths(node, rel, node.b_dirs, jobs);
 		}
 	}
+}
+
+// Collects the differences found in and above the listed paths inside a
+// directory, the same way as a walk would produce them
+std::vector<diff> collect_paths(path_node &dir) {
+	std::vector<diff> diffs;
+
+	for (auto &[name, node] : dir.children) {
+		std::ranges::move(node.diffs, std::back_inserter(diffs));
+		if (!node.a_dir)
+			continue;
+
+		auto sub_diff = collect_paths(node);
+		if (sub_diff.empty())
+			continue;
+
+		std::vector<int> trees;
+		for (const auto &sub : sub_diff)
+			trees.insert(trees.end(), sub.trees.begin(), sub.trees.end());
+
+		std::ranges::sort(trees);
+		trees.erase(std::unique(trees.begin(), trees.end()), trees.end());
+
+		auto b_path = std::ranges::find(node.b_dirs, trees.front(), &tree_entry::tree)->dentry.path();
+		auto summary = summarize(sub_diff);
+
+		diffs.push_back({diff_type::contents, -1, name,
+				node.a_dir->dentry.path(), b_path, std::move(sub_diff), std::move(trees)});
+		diffs.back().summary = summary;
+	}
+
+	// The differences of an entry and the ones above or inside it go
+	// together, as they would while walking
+	std::ranges::stable_sort(diffs, {}, &diff::name);
 
 	return diffs;
 }
+
+} // namespace anonymous
+
+std::vector<diff> diff_paths(const std::vector<tree_entry> &b_roots, const std::vector<std::string> &paths) {
+	// The roots aren't read, but like when walking, a root that isn't a
+	// directory is fatal (the trailing slash making stat fail then)
+	std::vector<int> trees{0};
+	for (const auto &b : b_roots)
+		trees.push_back(b.tree);
+
+	for (auto tree : trees) {
+		std::error_code ec;
+		path_status(roots[tree], ec);
+		if (ec)
+			throw walk_error{tree, roots[tree], ec};
+	}
+
+	path_node root;
+	for (const auto &path : paths) {
+		auto *node = &root;
+		for (const auto &component : fs::path{path})
+			node = &node->children[component.string()];
+
+		node->listed = true;
+	}
+
+	drop_inside_listed(root);
+
+	std::vector<path_job> jobs;
+	plan_paths(root, "", b_roots, jobs);
+
+	size_t n_threads = std::min<size_t>({std::max(1u, std::thread::hardware_concurrency()),
+			max_path_threads, jobs.size()});
+
+	// The threads take the paths in path order, so that the ones in the same
+	// directory are mostly compared one after another
+	std::atomic<size_t> next = 0;
+	std::atomic<bool> failed = false;
+	std::exception_ptr failure;
+
+	auto work = [&] {
+		// The files are hashed alongside each other already
+		bool was_parallel = std::exchange(hash_in_parallel, hash_in_parallel && n_threads == 1);
+
+		while (!failed) {
+			auto i = next++;
+			if (i >= jobs.size())
+				break;
+
+			try {
+				diff_listed(jobs[i]);
+			} catch (...) {
+				std::lock_guard lock{walk_mutex};
+				if (!failure)
+					failure = std::current_exception();
+				failed = true;
+			}
+		}
+
+		hash_in_parallel = was_parallel;
+	};
+
+	{
+		std::vector<std::jthread> threads;
+		for (size_t i = 1; i < n_threads; i++)
+			threads.emplace_back(work);
+
+		work();
+	}
+
+	if (failure)
+		std::rethrow_exception(failure);
+
+	return collect_paths(root);
+}
@@ -16,14 +16,49 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <filesystem>
+#include <functional>
 #include <string>
+#include <system_error>
+#include <sys/types.h>
 #include <vector>
 
 namespace fs = std::filesystem;
 
 enum class diff_type {
-	missing, file_type, contents
+	missing, file_type, contents, error
+};
+
+// What was compared to find out that the contents of files differ
+enum class diff_criterion {
+	contents, size, mtime
+};
+
+// Numbers of differing entries of each kind, and the bytes in them
+struct diff_summary {
+	std::uint64_t added = 0, removed = 0, type_changed = 0, contents_changed = 0, errors = 0;
+	std::uint64_t bytes = 0;
+
+	// Differing directories which haven't been walked yet, and whose
+	// contents are thus not included in the other numbers
+	std::uint64_t unwalked = 0;
+
+	std::uint64_t entries() const {
+		return added + removed + type_changed + contents_changed + errors + unwalked;
+	}
+
+	diff_summary &operator+=(const diff_summary &other) {
+		added += other.added;
+		removed += other.removed;
+		type_changed += other.type_changed;
+		contents_changed += other.contents_changed;
+		errors += other.errors;
+		bytes += other.bytes;
+		unwalked += other.unwalked;
+		return *this;
+	}
 };
 
 struct diff {
@@ -34,11 +69,250 @@ struct diff {
 	fs::path a_path = "", b_path = "";
 
 	std::vector<diff> sub_diffs = {};
+
+	// Indices of the trees this difference applies to (the reference
+	// tree being 0, and the trees compared against it starting at 1)
+	std::vector<int> trees = {};
+
+	// In a three-way diff, set if the entry was changed differently in both trees
+	bool conflict = false;
+
+	// Describes why the entry couldn't be compared, for errors
+	std::string error = "";
+
+	// Size in bytes of the entry, for regular files (0 if not known)
+	std::uint64_t size = 0;
+
+	// For files with different contents, what they were found to differ
+	// in (only ever something other than the contents with --quick)
+	diff_criterion criterion = diff_criterion::contents;
+
+	// For directories reached again through another symlink with
+	// follow_symlinks, the path (relative to the roots) under which they've
+	// been walked, and their differences reported
+	std::string same_as = "";
+
+	// For differing directories, summarizes the differences inside them
+	// (only once they've been walked)
+	diff_summary summary = {};
+
+	// For differing directories whose inner differences haven't been
+	// loaded yet, produces them on demand
+	std::function<std::vector<diff>()> lazy_sub_diffs = {};
+
+	// Set if lazy_sub_diffs walks the directories, rather than loading
+	// inner differences computed earlier
+	bool lazy_walk = false;
+};
+
+// Checks whether the entry is a directory with differences inside, whether
+// they've been loaded or not (or have been dropped, leaving only their summary)
+inline bool has_sub_diffs(const diff &diff) {
+	return diff.sub_diffs.size() || diff.lazy_sub_diffs || diff.summary.entries();
+}
+
+// Summarizes the difference, which for directories means the differences
+// inside them
+inline diff_summary summarize(const diff &diff) {
+	if (diff.lazy_walk)
+		return {.unwalked = 1};
+
+	if (has_sub_diffs(diff))
+		return diff.summary;
+
+	diff_summary summary{.bytes = diff.size};
+	switch (diff.type) {
+		case diff_type::missing: (diff.n ? summary.removed : summary.added) = 1; break;
+		case diff_type::file_type: summary.type_changed = 1; break;
+		case diff_type::contents: summary.contents_changed = 1; break;
+		case diff_type::error: summary.errors = 1; break;
+	}
+
+	return summary;
+}
+
+inline diff_summary summarize(const std::vector<diff> &diffs) {
+	diff_summary summary;
+	for (const auto &diff : diffs)
+		summary += summarize(diff);
+
+	return summary;
+}
+
+// Loads the inner differences of a directory, if they haven't been yet
+inline void expand_sub_diffs(diff &diff) {
+	if (diff.lazy_sub_diffs) {
+		diff.sub_diffs = diff.lazy_sub_diffs();
+		diff.lazy_sub_diffs = nullptr;
+
+		if (diff.lazy_walk)
+			diff.summary = summarize(diff.sub_diffs);
+		diff.lazy_walk = false;
+	}
+}
+
+// An entry of a directory, of which only the path is kept, along with the
+// inode number if it was found by listing the directory. Anything else is
+// looked up when needed, under the deadline of the lookup.
+class dir_entry {
+public:
+	dir_entry() = default;
+
+	explicit dir_entry(fs::path path, ino_t ino = 0)
+	: path_{std::move(path)}, ino_{ino} { }
+
+	const fs::path &path() const {
+		return path_;
+	}
+
+	ino_t ino() const {
+		return ino_;
+	}
+
+private:
+	fs::path path_;
+	ino_t ino_ = 0;
+};
+
+// A directory entry in one of the trees compared against the reference
+struct tree_entry {
+	int tree;
+	dir_entry dentry;
 };
 
+// Problems found while walking the trees, other than syscalls failing
+enum class walk_errc {
+	// A directory in one of the trees is the root of another one
+	overlapping_root = 1
+};
+
+template <>
+struct std::is_error_code_enum<walk_errc> : std::true_type { };
+
+std::error_code make_error_code(walk_errc err);
+
+// An entry in one of the trees that couldn't be read
+struct walk_error {
+	int tree;
+	fs::path path;
+	std::error_code ec;
+
+	std::string message() const {
+		return path.string() + ": " + ec.message();
+	}
+};
+
+// The reference tree is roots[0], the trees compared against it follow
+inline std::vector<fs::path> roots;
+
 inline bool paranoid = false;
 
-void update_progress(const fs::path &path);
-bool should_ignore_file(const fs::path &path, bool a_path);
+// Record entries that couldn't be read as errors and carry on, instead of
+// stopping at the first one by throwing a walk_error
+inline bool keep_going = false;
+
+// Number of errors recorded so far
+inline std::atomic<size_t> error_count = 0;
+
+enum class compare_mode {
+	// Read all files at the same time, comparing them chunk by chunk
+	lockstep,
+	// Hash each file on its own, one after another, and compare the digests
+	hash
+};
+
+inline compare_mode content_compare = compare_mode::lockstep;
+
+enum class quick_check {
+	// Compare the contents of regular files
+	none,
+	// Only compare the sizes of regular files
+	size,
+	// Compare the sizes and modification times (to the second) of regular
+	// files, like rsync's quick check
+	mtime
+};
+
+// Tell whether regular files differ from the stat(2) data alone, without
+// ever opening them
+inline quick_check quick_compare = quick_check::none;
+
+enum class walk_order {
+	// The order in which the directories list the entries
+	none,
+	// Ascending inode numbers
+	inode,
+	// Ascending physical location of the contents of regular files
+	physical
+};
+
+inline walk_order traversal_order = walk_order::none;
+
+// Start reading the files that are going to be compared next in the background
+inline bool prefetch = false;
+
+// Compare two trees against a common base (tree 0), instead of against a reference
+inline bool three_way = false;
+
+// Only compare the entries assigned to one of shard_count shards. Entries
+// shard_depth levels deep (or shallower, except for directories) are assigned
+// to shards by the hash of their path, and the directories above them are
+// walked by every shard.
+inline unsigned shard_index = 0;
+inline unsigned shard_count = 1;
+inline int shard_depth = 1;
+
+// Only check whether the directories this many levels deep (or deeper) differ,
+// leaving their inner differences to be computed once they're needed (-1
+// meaning that all directories are walked right away)
+inline int lazy_depth = -1;
+
+// Follow symlinks, comparing whatever they point to instead of their targets,
+// with dangling ones (and ones in a loop) being compared as symlinks still
+inline bool follow_symlinks = false;
+
+// Don't walk directories on other filesystems than the roots of their trees
+inline bool one_file_system = false;
+
+// Mount points which weren't walked with one_file_system, in the order they
+// were found in
+inline std::vector<fs::path> skipped_mounts;
+
+void update_progress(const fs::path &path, int tree);
+bool should_ignore_file(const fs::path &path, int tree);
+
+// How a path relates to the --only patterns
+enum class only_match {
+	// Neither the path nor anything inside it can match
+	none,
+	// Doesn't match, but if it's a directory, paths inside it could
+	partial,
+	// Matches, along with everything inside it
+	full
+};
+
+// Checks whether a directory, or a directory above it, matches the --only
+// patterns (or whether there are none), so that everything inside it is wanted
+bool is_only_included(const fs::path &dir, int tree);
+
+// Checks how an entry of a directory which isn't included as a whole relates
+// to the --only patterns
+only_match match_only(const fs::path &path, int tree);
+
+std::vector<diff> diff_trees(const tree_entry &a_dentry, const std::vector<tree_entry> &b_dentries);
+
+// Checks whether two directories are the same directory (like through a bind
+// mount, or a symlink to it), which can't differ. Errors are left for the walk
+// to report.
+bool is_same_directory(const tree_entry &a, const tree_entry &b);
+
+// Computes the differences in a directory given its path in the reference
+// tree, for finishing the walk of a directory left for later
+std::vector<diff> diff_directory(const fs::path &a_path);
 
-std::vector<diff> diff_trees(const fs::directory_entry &a_dentry, const fs::directory_entry &b_dentry);
+// Computes the differences in the given paths (relative to the roots) only,
+// instead of walking the whole trees. The directories above the paths are
+// only checked for being directories in every tree, and the paths themselves
+// are compared several at once, in path order (by name, not by their place
+// on the disk), with each file hashed on a single thread.
+std::vector<diff> diff_paths(const std::vector<tree_entry> &b_roots, const std::vector<std::string> &paths);
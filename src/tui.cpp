@@ -0,0 +1,467 @@
+/* Directory diff utility - Interactive browser
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <tui.hpp>
+#include <print.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <optional>
+#include <string_view>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+#include <wildmatch/wildmatch.hpp>
+
+namespace {
+
+// Unlike the colors, these are needed to show the cursor and status line
+const char *ansi_reverse = "\x1b[7m";
+const char *ansi_no_reverse = "\x1b[27m";
+const char *ansi_clear_line = "\x1b[2K";
+const char *ansi_home = "\x1b[H";
+
+volatile sig_atomic_t resized = 0;
+
+// Counts the characters in UTF-8 text, rather than the bytes
+size_t text_width(std::string_view text) {
+	return std::ranges::count_if(text, [] (char c) { return (c & 0xc0) != 0x80; });
+}
+
+// Cuts text down to at most width characters, without splitting any of them
+void truncate_text(std::string &text, size_t width) {
+	size_t chars = 0;
+	for (size_t i = 0; i < text.size(); i++) {
+		if ((text[i] & 0xc0) != 0x80 && chars++ == width) {
+			text.resize(i);
+			return;
+		}
+	}
+}
+
+// Switches the terminal to an alternate screen with unbuffered input for as
+// long as it's alive
+class terminal_mode {
+public:
+	terminal_mode() {
+		tcgetattr(STDIN_FILENO, &saved_);
+
+		auto raw = saved_;
+		raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+		raw.c_iflag &= ~(IXON | ICRNL);
+		raw.c_cc[VMIN] = 1;
+		raw.c_cc[VTIME] = 0;
+		tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+		// Without SA_RESTART, so that a pending read is interrupted
+		struct sigaction sa = {};
+		sa.sa_handler = [] (int) { resized = 1; };
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGWINCH, &sa, &saved_winch_);
+
+		write_str("\x1b[?1049h\x1b[?25l");
+	}
+
+	~terminal_mode() {
+		write_str("\x1b[?25h\x1b[?1049l");
+
+		sigaction(SIGWINCH, &saved_winch_, nullptr);
+		tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_);
+	}
+
+	terminal_mode(const terminal_mode &) = delete;
+	terminal_mode &operator=(const terminal_mode &) = delete;
+
+	static void write_str(std::string_view str) {
+		while (!str.empty()) {
+			auto ret = write(STDOUT_FILENO, str.data(), str.size());
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0)
+				return;
+
+			str.remove_prefix(ret);
+		}
+	}
+
+private:
+	termios saved_;
+	struct sigaction saved_winch_;
+};
+
+enum key : int {
+	key_none = -1,
+	key_up = 256, key_down, key_left, key_right,
+	key_page_up, key_page_down, key_home, key_end,
+	key_resize
+};
+
+// Waits for a key press, decoding the escape sequences of special keys
+int read_key() {
+	char buf[8];
+	auto ret = read(STDIN_FILENO, buf, sizeof(buf));
+	if (ret < 0 && errno == EINTR)
+		return resized ? key_resize : key_none;
+	if (ret <= 0)
+		return 'q';
+
+	std::string_view seq{buf, static_cast<size_t>(ret)};
+	if (seq.size() == 1 || seq[0] != '\x1b')
+		return static_cast<unsigned char>(seq[0]);
+
+	if (seq == "\x1b[A" || seq == "\x1bOA") return key_up;
+	if (seq == "\x1b[B" || seq == "\x1bOB") return key_down;
+	if (seq == "\x1b[C" || seq == "\x1bOC") return key_right;
+	if (seq == "\x1b[D" || seq == "\x1bOD") return key_left;
+	if (seq == "\x1b[5~") return key_page_up;
+	if (seq == "\x1b[6~") return key_page_down;
+	if (seq == "\x1b[H" || seq == "\x1bOH" || seq == "\x1b[1~") return key_home;
+	if (seq == "\x1b[F" || seq == "\x1bOF" || seq == "\x1b[4~") return key_end;
+
+	return key_none;
+}
+
+class browser {
+public:
+	browser(diff &root)
+	: root_{root} {
+		rows_.push_back({&root, 0});
+		expand(0);
+		update_size();
+	}
+
+	void run() {
+		while (true) {
+			draw();
+
+			int key = read_key();
+			message_.clear();
+
+			switch (key) {
+				case 'q': case 3: return;
+				case key_resize: update_size(); break;
+				case key_up: case 'k': move_to(cursor_ ? cursor_ - 1 : 0); break;
+				case key_down: case 'j': move_to(cursor_ + 1); break;
+				case key_page_up: move_to(cursor_ > page_size() ? cursor_ - page_size() : 0); break;
+				case key_page_down: case ' ': move_to(cursor_ + page_size()); break;
+				case key_home: case 'g': move_to(0); break;
+				case key_end: case 'G': move_to(rows_.size() - 1); break;
+				case key_right: case 'l': expand(cursor_); break;
+				case key_left: case 'h': collapse_or_leave(); break;
+				case '\r': case '\n': toggle(); break;
+				case '/': {
+					auto pattern = prompt("/");
+					if (pattern && !pattern->empty()) {
+						pattern_ = std::move(*pattern);
+						find_next();
+					}
+					break;
+				}
+				case 'n':
+					if (pattern_.empty())
+						message_ = "No pattern to search for";
+					else
+						find_next();
+					break;
+			}
+		}
+	}
+
+private:
+	struct row {
+		diff *entry;
+		int depth;
+	};
+
+	size_t page_size() const {
+		return std::max(1u, height_ - 1);
+	}
+
+	void update_size() {
+		resized = 0;
+
+		winsize ws;
+		if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col) {
+			width_ = ws.ws_col;
+			height_ = ws.ws_row;
+		}
+	}
+
+	void move_to(size_t idx) {
+		cursor_ = std::min(idx, rows_.size() - 1);
+	}
+
+	bool is_expanded(size_t idx) const {
+		return expanded_.contains(rows_[idx].entry);
+	}
+
+	// Inserts the rows for the children of an entry, and for the children
+	// of those that are expanded as well, returning the number of rows
+	size_t insert_children(size_t idx) {
+		auto &entry = *rows_[idx].entry;
+		auto depth = rows_[idx].depth + 1;
+
+		std::vector<row> children;
+		for (auto &sub : entry.sub_diffs)
+			children.push_back({&sub, depth});
+
+		rows_.insert(rows_.begin() + idx + 1, children.begin(), children.end());
+
+		auto end = idx + 1 + children.size();
+		for (auto i = idx + 1; i < end; i++) {
+			if (is_expanded(i)) {
+				auto count = insert_children(i);
+				end += count;
+				i += count;
+			}
+		}
+
+		return end - idx - 1;
+	}
+
+	void expand(size_t idx) {
+		auto &entry = *rows_[idx].entry;
+		if (!has_sub_diffs(entry) || is_expanded(idx))
+			return;
+
+		expand_sub_diffs(entry);
+		expanded_.insert(&entry);
+		insert_children(idx);
+	}
+
+	void collapse(size_t idx) {
+		expanded_.erase(rows_[idx].entry);
+
+		auto end = idx + 1;
+		while (end < rows_.size() && rows_[end].depth > rows_[idx].depth)
+			end++;
+
+		rows_.erase(rows_.begin() + idx + 1, rows_.begin() + end);
+	}
+
+	void toggle() {
+		if (is_expanded(cursor_))
+			collapse(cursor_);
+		else
+			expand(cursor_);
+	}
+
+	void collapse_or_leave() {
+		if (is_expanded(cursor_)) {
+			collapse(cursor_);
+			return;
+		}
+
+		auto depth = rows_[cursor_].depth;
+		while (cursor_ && rows_[cursor_].depth >= depth)
+			cursor_--;
+	}
+
+	struct search_state {
+		const diff *current;
+		bool passed;
+		bool wrapped;
+		bool stop = false;
+		bool skipped = false;
+	};
+
+	// Looks for the next entry matching the pattern in the order the entries
+	// are displayed in, loading the directories on the way, and leaves the
+	// path to it in path. Directories that haven't been walked yet are
+	// skipped, since searching them would walk the rest of the trees.
+	bool search_in(diff &entry, const std::string &rel, std::vector<diff *> &path, search_state &state) {
+		path.push_back(&entry);
+
+		if (&entry == state.current) {
+			if (state.wrapped) {
+				state.stop = true;
+				path.pop_back();
+				return false;
+			}
+
+			state.passed = true;
+		} else if (state.passed && !rel.empty() && wild::match(pattern_.c_str(), rel.c_str())) {
+			return true;
+		}
+
+		if (entry.lazy_walk) {
+			state.skipped = true;
+		} else if (has_sub_diffs(entry)) {
+			expand_sub_diffs(entry);
+
+			for (auto &sub : entry.sub_diffs) {
+				auto sub_rel = rel.empty() ? sub.name : rel + '/' + sub.name;
+				if (search_in(sub, sub_rel, path, state))
+					return true;
+				if (state.stop)
+					break;
+			}
+		}
+
+		path.pop_back();
+		return false;
+	}
+
+	void find_next() {
+		std::vector<diff *> path;
+		search_state state{rows_[cursor_].entry, false, false};
+
+		if (!search_in(root_, "", path, state)) {
+			// Continue from the top, up to the current entry
+			path.clear();
+			state = {rows_[cursor_].entry, true, true};
+
+			if (!search_in(root_, "", path, state)) {
+				message_ = "Pattern not found: " + pattern_;
+				if (state.skipped)
+					message_ += " (directories not walked yet were skipped, open them to search in them)";
+				return;
+			}
+
+			message_ = "Search wrapped around";
+		}
+
+		// Open the directories leading to the entry
+		size_t idx = 0;
+		for (size_t i = 1; i < path.size(); i++) {
+			expand(idx);
+
+			while (rows_[idx].entry != path[i])
+				idx++;
+		}
+
+		cursor_ = idx;
+	}
+
+	// Reads a line of text in the status line, returning std::nullopt if cancelled
+	std::optional<std::string> prompt(std::string_view prefix) {
+		std::string text;
+
+		while (true) {
+			terminal_mode::write_str(fmtns::format("\x1b[{0};1H{1}{2}{3}{4}",
+					height_, ansi_clear_line, prefix, text, ansi_reset));
+
+			int key = read_key();
+			switch (key) {
+				case key_resize: update_size(); draw(); break;
+				case '\x1b': case 3: return std::nullopt;
+				case '\r': case '\n': return text;
+				case 127: case '\b':
+					if (!text.empty())
+						text.pop_back();
+					break;
+				default:
+					if (key >= ' ' && key < 127)
+						text.push_back(static_cast<char>(key));
+					break;
+			}
+		}
+	}
+
+	std::string format_row(const row &row) const {
+		const auto &entry = *row.entry;
+
+		std::string text;
+		for (int i = 0; i < row.depth; i++)
+			text += "|  ";
+
+		if (has_sub_diffs(entry))
+			text += expanded_.contains(&entry) ? "v " : "> ";
+		else
+			text += "  ";
+
+		const char *color = ansi_yellow;
+		switch (entry.type) {
+			using enum diff_type;
+			case missing:
+				color = entry.n ? ansi_red : ansi_green;
+				text += entry.n ? "- " : "+ ";
+				break;
+			case file_type: color = ansi_blue; text += "! "; break;
+			case contents: text += "? "; break;
+			case error: color = ansi_magenta; text += "E "; break;
+		}
+
+		text += entry.name;
+		text += format_trees(entry);
+		text += format_criterion(entry);
+		if (entry.type == diff_type::error)
+			text += " (" + entry.error + ")";
+
+		// The differences in directories that haven't been walked yet are unknown
+		if (has_sub_diffs(entry) && !entry.lazy_walk)
+			text += " (" + format_summary(entry.summary) + ")";
+
+		truncate_text(text, width_);
+
+		return color + text + ansi_reset;
+	}
+
+	void draw() {
+		auto view = page_size();
+
+		// Keep the cursor in view
+		if (cursor_ < top_)
+			top_ = cursor_;
+		else if (cursor_ >= top_ + view)
+			top_ = cursor_ - view + 1;
+
+		std::string frame = ansi_home;
+
+		for (size_t i = top_; i < top_ + view; i++) {
+			frame += ansi_clear_line;
+			if (i < rows_.size()) {
+				if (i == cursor_)
+					frame += ansi_reverse;
+				frame += format_row(rows_[i]);
+				if (i == cursor_)
+					frame += ansi_no_reverse;
+			}
+			frame += "\r\n";
+		}
+
+		auto status = fmtns::format(" {0}/{1}  {2}", cursor_ + 1, rows_.size(), message_);
+		std::string_view help = "arrows: move/open/close  /: search  n: next  q: quit ";
+		auto status_width = text_width(status);
+		if (status_width + help.size() < width_)
+			status += std::string(width_ - status_width - help.size(), ' ') + std::string{help};
+		truncate_text(status, width_);
+
+		frame += ansi_clear_line;
+		frame += ansi_reverse + status + ansi_no_reverse;
+
+		terminal_mode::write_str(frame);
+	}
+
+	diff &root_;
+	std::vector<row> rows_;
+	std::unordered_set<const diff *> expanded_;
+
+	size_t cursor_ = 0, top_ = 0;
+	unsigned width_ = 80, height_ = 24;
+
+	std::string pattern_;
+	std::string message_;
+};
+
+} // namespace anonymous
+
+void browse_diffs(diff &root) {
+	terminal_mode mode;
+	browser{root}.run();
+}
@@ -0,0 +1,43 @@
+/* Directory diff utility - Interactive browser
+ * Copyright (C) 2022  qookie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <tree.hpp>
+#include <string>
+
+// The colors the differences are printed in, empty with --color=never
+extern const char *ansi_reset;
+extern const char *ansi_red;
+extern const char *ansi_green;
+extern const char *ansi_yellow;
+extern const char *ansi_blue;
+extern const char *ansi_magenta;
+
+// Lists the trees a difference applies to, if there's more than one
+std::string format_trees(const diff &diff);
+
+// Describes the numbers of differences in a summary
+std::string format_summary(const diff_summary &summary);
+
+// Tells what a file was found to differ in, if it wasn't the contents, or
+// where a directory reached again through a symlink has been walked
+std::string format_criterion(const diff &diff);
+
+// Lets the user browse the differences in the terminal, loading the inner
+// differences of directories as they're opened. Both the standard input and
+// output have to be a terminal.
+void browse_diffs(diff &root);
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Sharding test
+# Copyright (C) 2022  qookie
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License, version 3, as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Compares a pair of small trees in three shards, merges the results, and
+# checks that the report is the same as that of a single run, with the
+# entries assigned to shards at different depths. Takes the path to dir-diff.
+
+set -e
+
+dir_diff=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Creates a file with the given contents, along with the directories above it
+put() {
+	mkdir -p "$(dirname "$1")"
+	printf '%s\n' "$2" > "$1"
+}
+
+a=$work/a
+b=$work/b
+
+for i in 1 2 3 4 5 6 7 8; do
+	# Files in the roots, every other one changed
+	put "$a/f$i" same
+	put "$b/f$i" "$([ $((i % 2)) = 0 ] && echo changed || echo same)"
+
+	# Entries deeper than the depth they're assigned to shards at
+	put "$a/d$i/sub/deep/x" same
+	put "$b/d$i/sub/deep/x" "$([ $((i % 3)) = 0 ] && echo changed || echo same)"
+	put "$a/d$i/sub/only-a$i" a
+	put "$b/d$i/only-b$i" b
+done
+
+# Only in one of the trees, and of different types
+put "$a/gone/x" a
+put "$b/new/x" b
+put "$a/retyped" file
+put "$b/retyped/x" dir
+put "$a/d1/sub/retyped/x" dir
+put "$b/d1/sub/retyped" file
+
+"$dir_diff" -c never -l "$a" "$b" > "$work/expected"
+
+# Make sure the differences deeper down are part of what's compared
+grep -q 'deep' "$work/expected"
+
+for depth in 1 2 3; do
+	for k in 1 2 3; do
+		"$dir_diff" -q -c never -l --shard=$k/3 --shard-depth=$depth \
+			--save="$work/$k.res" "$a" "$b" > /dev/null
+	done
+
+	"$dir_diff" merge -c never -l "$work/1.res" "$work/2.res" "$work/3.res" > "$work/merged"
+
+	if ! diff -u "$work/expected" "$work/merged"; then
+		echo "Merged shards differ from a single run with --shard-depth=$depth" >&2
+		exit 1
+	fi
+done